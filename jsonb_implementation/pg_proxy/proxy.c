@@ -2,15 +2,28 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <errno.h>
 #include <netinet/in.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <stdint.h>
+#include <math.h>
 #include <ev.h>
 #include "postgres.h"
 #include "postmaster/bgworker.h"
 #include "fmgr.h"
+#include "miscadmin.h"
+#include "access/xact.h"
+#include "executor/spi.h"
+#include "parser/parse_param.h"
+#include "utils/builtins.h"
+#include "utils/guc.h"
+#include "utils/lsyscache.h"
+#include "utils/snapmgr.h"
 #include "postgresql/libpq-fe.h"
-#include <json-c/json.h>
+#include "postgresql/libpq-events.h"
 #include <libbson-1.0/bson.h>
 #include "catalog/pg_type.h"
 #include "coro.h"
@@ -23,6 +36,13 @@ PG_MODULE_MAGIC;
 
 #define MONGO_PORT 3463
 #define BUFFER_SIZE 1024 * 3
+#define MSG_HEADER_LEN 16            /* msg_length, request_id, response_to, op_code */
+#define MAX_MESSAGE_SIZE 48000000    /* maxMessageSizeBytes announced in the hello reply */
+#define READ_CHUNK_SIZE (16 * 1024)  /* free space of the read buffer before every recv */
+#define READ_BUFFER_KEEP_SIZE (1024 * 1024) /* a larger read buffer is freed once it is empty */
+#define OUTPUT_HIGH_WATER (8 * 1024 * 1024) /* queued reply bytes above which the client is not read from */
+#define OUTPUT_LOW_WATER (1024 * 1024)     /* reading resumes once the queue drains below this */
+#define OUTPUT_IOV_MAX 64            /* queued replies written by one writev */
 #define OP_QUERY 2004
 #define OP_REPLY 1
 #define OP_MSG 2013
@@ -32,24 +52,240 @@ PG_MODULE_MAGIC;
 #define PG_CONNINFO "dbname=postgres user=user1 password=passwd host=localhost port=5433"
 #define BODY_MSG_SECTION_TYPE 0
 #define DOC_MSG_SECTION_TYPE 1
-#define MAX_BSON_OBJECTS 10
 #define STACK_SIZE (1024 * 1024)
 
-PGDLLEXPORT int main_proxy(void);
+#define PG_CONNINFO_TEMPLATE "dbname=%s user=user1 password=passwd port=5433"
+#define POOL_MAX_DATABASES 64
+#define POOL_MIN_SIZE 2               /* warm connections kept per database */
+#define POOL_MAX_SIZE 16              /* upper bound of connections per database */
+#define POOL_IDLE_TIMEOUT 60.0        /* seconds before a connection above POOL_MIN_SIZE is closed */
+#define POOL_MAX_LIFETIME 1800.0      /* seconds before a connection is recycled */
+#define POOL_HEALTH_CHECK_IDLE 10.0   /* seconds of idleness after which a connection is pinged before use */
+#define POOL_MAINTENANCE_INTERVAL 5.0 /* seconds between reaping/refilling passes */
+#define POOL_WAIT_INTERVAL 0.001     /* seconds between attempts to get a connection from exhausted pool */
+#define POOL_ACQUIRE_TIMEOUT 30.0    /* seconds a client waits for a connection from exhausted pool */
+#define PROXY_BACKEND_LIBPQ 0         /* commands go through loopback libpq connections of the pools */
+#define PROXY_BACKEND_SPI 1           /* commands to pg_proxy.database run inside the worker's own backend */
+#define PROXY_MAX_WORKERS 64
+#define PROXY_STATS_INTERVAL 60.0     /* seconds between reports of worker counters */
+#define STMT_CACHE_SIZE 64            /* prepared statements kept per connection, least recently used is evicted */
+#define COPY_MIN_DOCUMENTS 64        /* inserts of at least this many documents are loaded with COPY */
+#define COPY_CHUNK_SIZE (64 * 1024)   /* COPY data is handed to libpq in chunks of this size */
+#define INSERT_MAX_PARAMS 65535      /* protocol limit of parameters in one statement */
+#define FIND_MAX_BATCH_SIZE (16 * 1024 * 1024) /* a batch stops growing at the maximum BSON document size */
+#define FIND_FIRST_BATCH_SIZE 101     /* documents in the first batch of a find without batchSize, as mongod returns */
+#define CURSOR_MAX_OPEN 64            /* cursors a worker keeps open at once, each of them pins a connection */
+#define CURSOR_MAX_PER_DATABASE (POOL_MAX_SIZE / 2) /* cursors of a database, fewer than its pool has connections */
+#define CURSOR_IDLE_TIMEOUT 600.0     /* seconds an unused cursor stays open, the default of mongod as well */
+#define CURSOR_FETCH_SIZE 1000        /* rows fetched from a portal at once */
+#define CURSOR_WORKER_SHIFT 56        /* a cursor id has the index of the worker owning it above this bit */
+#define INDEX_LOCK_TIMEOUT "60s"      /* how long concurrent index builds and drops wait for older transactions */
+#define FIND_REPLY_CURSOR_AT 33       /* offset of the cursor document in a find reply, after the header and "cursor" key */
+#define FIND_SORT_MAX_KEYS 8          /* fields a find sorts by at most, the row id is added to them as the last key */
+#define KEYSET_CACHE_SIZE 64          /* sorted pages whose last sort key is remembered for the page after them */
+#define KEYSET_TTL 60.0               /* seconds a remembered sort key starts the next page instead of OFFSET */
+#define SAMPLE_TABLE_RATIO 100        /* $sample reads TABLESAMPLE of tables with this many rows per document asked */
+#define SAMPLE_SPARE_ROWS 1000        /* rows TABLESAMPLE reads beyond 4 times the size asked, as its blocks vary */
+#define SCHEMA_REFRESH_INTERVAL 60.0  /* seconds a created table is trusted to exist without asking the server */
+
+/* reply waiting in the output queue of a client, sent is how much of the first one already went out */
+typedef struct out_chunk {
+    struct out_chunk *next;
+    unsigned char *data;    /* points right after the chunk when the reply was copied */
+    size_t len;
+} out_chunk_t;
+
+typedef struct {
+    struct ev_io io;
+    int fd;
+    coro_context ctx;
+    coro_context main_ctx;
+    struct ev_io pg_io;     /* socket of the PGconn the client waits for */
+    int pg_revents;
+    struct ev_timer timer;
+    bool closed;
+    unsigned char *rbuf;    /* bytes read from the client, at most one incomplete message after a read */
+    size_t rbuf_len;
+    size_t rbuf_cap;
+    struct ev_io write_io;  /* started while the output queue waits for the socket */
+    out_chunk_t *out_head;
+    out_chunk_t *out_tail;
+    size_t out_sent;
+    size_t out_queued;      /* bytes of the queue not sent yet */
+    bool read_paused;       /* the client is not read from until its queue drains to OUTPUT_LOW_WATER */
+    char stack[STACK_SIZE];
+} client_t;
+
+/* prepared statement of a connection, or SPI plan of the worker's own backend */
+typedef struct {
+    char *query;          /* parameterized statement, its text is the shape key: table, filter keys, operators, limit */
+    uint32 hash;
+    char name[NAMEDATALEN];
+    SPIPlanPtr plan;
+    uint64 last_used;     /* 0 for an empty slot */
+    int result_format;    /* format of results when binary ones are asked for, -1 until the statement is described */
+} cached_stmt_t;
+
+typedef struct {
+    cached_stmt_t stmts[STMT_CACHE_SIZE];
+    uint64 clock;         /* incremented on every use, orders statements for LRU eviction */
+    uint64 next_id;
+} stmt_cache_t;
+
+/* text parameters of a query built by the translators, NULL value is SQL NULL */
+typedef struct {
+    int count;
+    int capacity;
+    char **values;
+} query_params_t;
+
+typedef struct {
+    Oid *types;
+    int count;
+} spi_param_types_t;
+
+/* one statement of a command executed with proxy_exec_pipeline */
+typedef struct {
+    char *query;
+    query_params_t params;
+} proxy_stmt_t;
+
+/* table known to exist, trusted for SCHEMA_REFRESH_INTERVAL after it was checked */
+typedef struct {
+    char name[NAMEDATALEN];
+    ev_tstamp checked_at;
+} schema_table_t;
+
+/* tables of one database, the database itself is checked once when its pool is created */
+typedef struct {
+    char dbname[NAMEDATALEN];
+    int n_tables;
+    int tables_capacity;
+    schema_table_t *tables;
+} schema_db_t;
+
+/* documents of one OP_MSG: the body first, then documents of kind 1 sections in order they came */
+typedef struct {
+    int count;
+    int capacity;
+    bson_t **docs;
+} mongo_msg_t;
+
+/* COPY FROM STDIN data of one command, sent to the server in chunks while it is built */
+typedef struct {
+    PGconn *conn;
+    char *data;
+    size_t len;
+    size_t capacity;
+    bool failed;
+} copy_buf_t;
+
+/* rows of a query read from the server one at a time, see proxy_stream_begin */
+typedef struct {
+    PGconn *conn;
+    const char *query;
+    const query_params_t *params;
+    bool binary;
+    cached_stmt_t *stmt;
+    PGresult *spi_result; /* SPI has no single-row mode, its whole result is returned as one chunk */
+    uint64 rows;
+    bool retried;
+    bool done;
+} proxy_stream_t;
+
+/**
+ * find reply {cursor: {firstBatch: [...], id, ns}, ok} is written straight into its OP_MSG packet,
+ * lengths of the body, the cursor and the batch are filled in by find_reply_finish.
+ * body holds an error reply instead
+ */
+typedef struct {
+    bson_t body;
+    unsigned char *packet;
+    size_t len;
+    size_t cap;
+    size_t array_at;      /* offset of the batch array, firstBatch or nextBatch in a getMore reply */
+    uint32_t n_docs;
+    int64 cursor_id;      /* 0 unless a cursor stays open for getMore */
+    bool started;         /* the packet has the cursor and its batch open */
+    int key_columns;      /* sort keys selected after the columns of the documents, see find_reply_keep_key */
+    char *last_key[FIND_SORT_MAX_KEYS + 1];  /* sort keys of the row appended last */
+} find_reply_t;
+
+typedef struct conn_pool conn_pool_t;
+
+typedef struct {
+    PGconn *conn;
+    conn_pool_t *pool;
+    ev_tstamp created_at;
+    ev_tstamp last_used_at;
+    ev_tstamp checked_at;
+    bool in_use;
+} pooled_conn_t;
+
+/* open cursor of a find, its rows are fetched from a portal declared on the connection pinned to the cursor */
+typedef struct {
+    int64 id;
+    pooled_conn_t *pc;
+    char name[32];        /* name of the portal */
+    char dbname[256];
+    char collection[256];
+    int result_format;    /* format of FETCH results, binary if every column can be decoded */
+    PGresult *pending;    /* fetched rows the previous batch had no room for */
+    int pending_row;
+    bool exhausted;       /* the portal has no rows after pending ones */
+    bool busy;            /* a command of the cursor is running, it is neither killed nor reaped meanwhile */
+    ev_tstamp last_used_at;
+} proxy_cursor_t;
+
+/* expression a sorted find orders rows by, its value is selected in text after the columns of the documents */
+typedef struct {
+    char expr[NAMEDATALEN * 4];
+    const char *cast;     /* cast of parameters compared with the expression */
+    bool desc;
+} sort_key_t;
+
+/* sort keys of the last row of a sorted page, the page after it starts past the keys instead of skipping rows */
+typedef struct {
+    char *signature;      /* database, statement without the paging and values of its parameters */
+    char dbname[NAMEDATALEN];
+    char table_name[NAMEDATALEN];  /* table the statement reads, writes to it through the worker forget the keys */
+    int64 end;            /* skip of the page after it */
+    int n_values;
+    char *values[FIND_SORT_MAX_KEYS + 1];  /* sort keys and the row id in text, NULL for SQL NULL */
+    ev_tstamp used_at;    /* 0 for an empty slot */
+} keyset_t;
+
+/* Warm connections to a single database */
+struct conn_pool {
+    char dbname[NAMEDATALEN];
+    char conninfo[BUFFER_SIZE];
+    pooled_conn_t conns[POOL_MAX_SIZE];
+    int size;
+};
+
+PGDLLEXPORT int main_proxy(Datum main_arg);
 
 void accept_cb(struct ev_loop *loop, struct ev_io *watcher, int revents);
 
 void read_cb(struct ev_loop *loop, struct ev_io *watcher, int revents);
 
+static void client_handle_read(struct ev_loop *loop, client_t *client);
+
+static void client_handle_message(client_t *client, unsigned char *buffer, u_int32_t msg_length);
+
 void write_cb(struct ev_loop *loop, struct ev_io *watcher, int revents);
 
 void
-process_message(uint32_t response_to, unsigned char *buffer, char *json_metadata, char *json_data_array,
-                int *flag, struct json_object **results, char **dbname, char **collection, int *changed_count);
+process_message(uint32_t response_to, unsigned char *buffer, const mongo_msg_t *msg, int *flag,
+                find_reply_t *find_reply, char **dbname, char **collection, int *changed_count);
 
 void parse_mongodb_packet(char *buffer, char **query_string, char **parameter_string);
 
-int parse_message(char *buffer, char **query_string, char **parameter_string);
+int parse_message(char *buffer, mongo_msg_t *msg);
+
+void mongo_msg_add(mongo_msg_t *msg, bson_t *doc);
+
+void mongo_msg_free(mongo_msg_t *msg);
 
 int parse_bson_object(char *my_data, bson_t **my_bson);
 
@@ -57,31 +293,99 @@ ssize_t get_str_len_from_doc_seq(char *doc_seq);
 
 bool check_and_create_database(PGconn *conn, const char *dbname);
 
+PGconn *proxy_connect(const char *conninfo);
+
+PGresult *proxy_exec(PGconn *conn, const char *query);
+
+PGresult *proxy_exec_params(PGconn *conn, const char *query, int n_params, const char *const *param_values);
+
+PGresult *proxy_exec_cached(PGconn *conn, const char *query, const query_params_t *params, bool binary);
+
+bool pg_binary_type_supported(Oid type);
+
+bool proxy_stream_begin(proxy_stream_t *stream, PGconn *conn, const char *query, const query_params_t *params,
+                        bool binary);
+
+PGresult *proxy_stream_next(proxy_stream_t *stream);
+
+void proxy_stream_close(proxy_stream_t *stream);
+
+void find_reply_init(find_reply_t *reply);
+
+unsigned char *find_reply_finish(find_reply_t *reply, uint32_t response_to, const char *db_name,
+                                 const char *table_name, size_t *len);
+
+void find_reply_free(find_reply_t *reply);
+
+void find_reply_begin(find_reply_t *reply, const char *batch_name);
+
+void find_reply_error(find_reply_t *reply, int code, const char *code_name, const char *errmsg);
+
+const char *find_reply_errmsg(const find_reply_t *reply);
+
+unsigned char *op_msg_pack(const bson_t *body, uint32_t response_to, size_t *len);
+
+void cursor_reap(ev_tstamp now);
+
+bool cursor_close_lru(const char *dbname);
+
+void keyset_invalidate(const char *dbname, const char *table_name);
+
+bool proxy_exec_pipeline(PGconn *conn, proxy_stmt_t *stmts, int n_stmts, bool cached, bool atomic, int *affected);
+
+void query_add_param(query_params_t *params, char *buf, size_t buf_size, const char *value);
+
+void query_params_free(query_params_t *params);
+
+conn_pool_t *pool_get(const char *dbname);
+
+pooled_conn_t *pool_acquire(const char *dbname);
+
+pooled_conn_t *pool_acquire_libpq(const char *dbname);
+
+void pool_release(pooled_conn_t *pc);
+
+void pool_prewarm(void);
+
+void pool_maintenance(ev_tstamp now);
+
 bool check_and_create_table(PGconn *conn, const char *table_name);
 
-const char *get_json_value_as_string(struct json_object *field_value);
+bool execute_insert_queries(PGconn *conn, const char *table_name, bson_t **docs, int n_docs, int *inserted_count);
 
-bool execute_insert_queries(PGconn *conn, const char *table_name, struct json_object *data_array, int *inserted_count);
+bool execute_insert_copy(PGconn *conn, const char *table_name, bson_t **docs, int n_docs, int *inserted_count);
 
-bool execute_query_insert_to_postgres(const char *json_metadata, const char *json_data_array, int *inserted_count);
+bool execute_query_insert_to_postgres(const mongo_msg_t *msg, int *inserted_count);
 
-bool execute_delete_queries(PGconn *conn, const char *table_name, struct json_object *delete_array, int *deleted_count);
+bool execute_delete_queries(PGconn *conn, const char *table_name, bson_t **deletes, int n_deletes, int *deleted_count);
 
-bool execute_query_delete_to_postgres(const char *json_metadata, const char *json_data_array, int *deleted_count);
+bool execute_query_delete_to_postgres(const mongo_msg_t *msg, int *deleted_count);
 
-void build_jsonb_path_condition(struct json_object *q_json, char *jsonpath_condition);
+bool build_jsonb_filter_condition(const bson_t *q, char *condition, size_t size, query_params_t *params);
 
 void build_jsonb_path(const char *key, char *path);
 
-bool execute_update_queries(PGconn *conn, const char *table_name, struct json_object *update_array, int *updated_count);
+bool execute_update_queries(PGconn *conn, const char *table_name, bson_t **updates, int n_updates, int *updated_count);
 
-bool execute_query_update_to_postgres(const char *json_metadata, const char *json_data_array, int *updated_count);
+bool execute_query_update_to_postgres(const mongo_msg_t *msg, int *updated_count);
 
 bool
-execute_find_query(PGconn *conn, const char *table_name, struct json_object *find_json, struct json_object **results);
+execute_find_query(pooled_conn_t *pc, const char *dbname, const char *table_name, const bson_t *find,
+                   find_reply_t *reply);
+
+bool execute_query_find_to_postgres(const mongo_msg_t *msg, find_reply_t *reply, char **collection, char **dbname);
+
+bool execute_query_aggregate(const mongo_msg_t *msg, find_reply_t *reply, char **collection, char **dbname);
 
-bool execute_query_find_to_postgres(const char *json_metadata, struct json_object **results, char **collection,
-                                    char **dbname);
+bool execute_query_getmore(const mongo_msg_t *msg, find_reply_t *reply, char **collection, char **dbname);
+
+void execute_query_killcursors(const mongo_msg_t *msg, find_reply_t *reply);
+
+bool execute_query_create_indexes(const mongo_msg_t *msg, find_reply_t *reply);
+
+bool execute_query_list_indexes(const mongo_msg_t *msg, find_reply_t *reply, char **collection, char **dbname);
+
+bool execute_query_drop_indexes(const mongo_msg_t *msg, find_reply_t *reply);
 
 void cleanup_and_exit(struct ev_loop *loop, int server_sd);
 
@@ -97,19 +401,6 @@ void modify_update_reply(unsigned char *reply, u_int32_t response_to, int nmodif
 
 void random_new_req_id(unsigned char *buffer);
 
-int reply_find_generate_array_element_i(struct json_object *data_json, char *buffer, int place_to_put, int number_of_el);
-int generate_find_reply_packet(struct json_object *data_array, char *reply, uint32_t response_to, char *db_name, char *table_name);
-int generate_cursor(struct json_object *data_array, char *reply, char *db_name, char *table_name);
-int generate_ns_element(char *reply, char *db_name, char *table_name);
-void reply_find_process_string(const char *field_str, const char *value_str, char *buffer, int *now_to_put);
-void reply_find_process_int32(const char *field_str, const char *value_str, char *buffer, int *now_to_put);
-void reply_find_process_boolean(const char *field_str, const char *value_str, char *buffer, int *now_to_put);
-void reply_find_process_double(const char *field_str, const char *value_str, char *buffer, int *now_to_put);
-int reply_find_process_array(const char *field_str, struct json_object *data_json, char *buffer, int place_to_put);
-int reply_find_generate_subelemets_string(struct json_object *data_json, char *buffer, int place_to_put);
-int get_type_of_value(struct json_object *field_value);
-int reply_find_process_object(const char *field_str, struct json_object *data_json, char *buffer, int place_to_put);
-int reply_find_process_oid(const char *field_str, struct json_object *data_json, char *buffer, int place_to_put);
 
 
 
@@ -121,741 +412,4270 @@ static void handle_sigterm(int sig, int server_sd) {
     exit(0);
 }
 
-/* Check if database exists, and if not, create it.
-   Returns true if database exists or was created successfully, false otherwise. */
-bool check_and_create_database(PGconn *conn, const char *dbname) {
-    char query[BUFFER_SIZE];
-    PGresult *res;
-    snprintf(query, sizeof(query), "SELECT 1 FROM pg_database WHERE datname='%s'", dbname);
-
-    res = PQexec(conn, query);
-    if (PQresultStatus(res) != PGRES_TUPLES_OK) {
-        PQclear(res);
-        return false;
+/* client whose coroutine is running now, NULL when the code runs on the main context (event loop) */
+static client_t *current_client = NULL;
+
+/* pg_proxy.backend and pg_proxy.database settings, see _PG_init */
+static int proxy_backend = PROXY_BACKEND_LIBPQ;
+static char *proxy_database = NULL;
+
+/* pg_proxy.workers setting, number of worker processes accepting clients on MONGO_PORT */
+static int proxy_workers = 1;
+
+/* counters of this worker, logged every PROXY_STATS_INTERVAL to check that clients are balanced between workers */
+static int worker_index = 0;
+static uint64 worker_accepted = 0;
+static uint64 worker_commands = 0;
+static int worker_active = 0;
+static struct ev_timer worker_stats_timer;
+
+static const struct config_enum_entry proxy_backend_options[] = {
+        {"libpq", PROXY_BACKEND_LIBPQ, false},
+        {"spi",   PROXY_BACKEND_SPI,   false},
+        {NULL, 0,                      false}
+};
+
+static void client_drop_output(client_t *client) {
+    while (client->out_head != NULL) {
+        out_chunk_t *chunk = client->out_head;
+        client->out_head = chunk->next;
+        if (chunk->data != (unsigned char *) (chunk + 1)) {
+            free(chunk->data);
+        }
+        free(chunk);
     }
+    client->out_tail = NULL;
+    client->out_sent = 0;
+    client->out_queued = 0;
+}
 
-    // ALTER USER user1 CREATEDB;
-    /* If database does not exist, create it. */
-    if (PQntuples(res) == 0) {
-        PQclear(res);
-        snprintf(query, sizeof(query), "CREATE DATABASE %s", dbname);
-        res = PQexec(conn, query);
-        if (PQresultStatus(res) != PGRES_COMMAND_OK) {
-            PQclear(res);
-            return false;
+/**
+ * writes as much of the output queue as the socket takes without blocking,
+ * the rest is written by write_cb once the socket is writable again
+ */
+static void client_flush(client_t *client) {
+    struct ev_loop *loop = ev_default_loop(0);
+
+    while (client->out_head != NULL && !client->closed) {
+        struct iovec iov[OUTPUT_IOV_MAX];
+        int n_iov = 0;
+
+        for (out_chunk_t *chunk = client->out_head; chunk != NULL && n_iov < OUTPUT_IOV_MAX; chunk = chunk->next) {
+            size_t skip = n_iov == 0 ? client->out_sent : 0;
+            iov[n_iov].iov_base = chunk->data + skip;
+            iov[n_iov].iov_len = chunk->len - skip;
+            n_iov++;
+        }
+
+        ssize_t written = writev(client->fd, iov, n_iov);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            perror("write error");
+            client->closed = true;
+            break;
+        }
+
+        client->out_queued -= written;
+        written += client->out_sent;
+        while (client->out_head != NULL && (size_t) written >= client->out_head->len) {
+            out_chunk_t *chunk = client->out_head;
+            written -= chunk->len;
+            client->out_head = chunk->next;
+            if (chunk->data != (unsigned char *) (chunk + 1)) {
+                free(chunk->data);
+            }
+            free(chunk);
+        }
+        if (client->out_head == NULL) {
+            client->out_tail = NULL;
         }
+        client->out_sent = written;
     }
 
-    PQclear(res);
-    return true;
+    if (client->out_head != NULL && !client->closed) {
+        ev_io_start(loop, &client->write_io);
+    } else {
+        ev_io_stop(loop, &client->write_io);
+    }
 }
 
-/* Check if table exists, and if not, create it.
-   Returns true if table exists or was created successfully, false otherwise. */
-bool check_and_create_table(PGconn *conn, const char *table_name) {
-    char query[BUFFER_SIZE];
-    PGresult *res;
-
-    /* Create table if it does not exist. */
-    snprintf(query, sizeof(query),
-             "CREATE TABLE IF NOT EXISTS %s ("
-             "_id SERIAL PRIMARY KEY, "
-             "data JSONB)",
-             table_name);
+static void client_enqueue(client_t *client, out_chunk_t *chunk, unsigned char *data, size_t len) {
+    chunk->next = NULL;
+    chunk->data = data;
+    chunk->len = len;
+    if (client->out_tail != NULL) {
+        client->out_tail->next = chunk;
+    } else {
+        client->out_head = chunk;
+    }
+    client->out_tail = chunk;
+    client->out_queued += len;
 
-    res = PQexec(conn, query);
-    if (PQresultStatus(res) != PGRES_COMMAND_OK) {
-        fprintf(stderr, "Table creation failed: %s\n", PQerrorMessage(conn));
-        PQclear(res);
-        return false;
+    /* while write_cb waits for the socket, replies only join the queue to keep their order */
+    if (!ev_is_active(&client->write_io)) {
+        client_flush(client);
     }
+}
 
-    PQclear(res);
-    return true;
+/* queues a copy of the reply, for replies built on the stack */
+static void client_send(client_t *client, const unsigned char *reply, size_t len) {
+    if (client->closed) {
+        return;
+    }
+    out_chunk_t *chunk = (out_chunk_t *) malloc(sizeof(out_chunk_t) + len);
+    memcpy(chunk + 1, reply, len);
+    client_enqueue(client, chunk, (unsigned char *) (chunk + 1), len);
 }
 
-/* Retrieve string representation of JSON value.
-   Returns string representation of JSON value if it is of a recognized type, NULL otherwise. */
-const char *get_json_value_as_string(struct json_object *field_value) {
-    if (json_object_is_type(field_value, json_type_string)) {
-        return json_object_get_string(field_value);
-    } else if (json_object_is_type(field_value, json_type_int)) {
-        return json_object_to_json_string(field_value);
-    } else if (json_object_is_type(field_value, json_type_boolean)) {
-        return json_object_to_json_string(field_value);
-    } else if (json_object_is_type(field_value, json_type_double)) {
-        return json_object_to_json_string(field_value);
+/* queues malloc'd packet, the queue frees it once it is sent */
+static void client_send_packet(client_t *client, unsigned char *packet, size_t len) {
+    if (client->closed) {
+        free(packet);
+        return;
     }
-    return NULL;
+    client_enqueue(client, (out_chunk_t *) malloc(sizeof(out_chunk_t)), packet, len);
 }
 
-/* Executes insert queries for each JSON object in data array into specified table.
-   Updates inserted count and returns true if all inserts were successful, false otherwise. */
-bool execute_insert_queries(PGconn *conn, const char *table_name, struct json_object *data_array, int *inserted_count) {
-    int array_length = json_object_array_length(data_array);
-    *inserted_count = 0;
+static void client_resume(client_t *client) {
+    current_client = client;
+    coro_transfer(&client->main_ctx, &client->ctx);
+    current_client = NULL;
+
+    if (client->closed) {
+        ev_io_stop(ev_default_loop(0), &client->write_io);
+        client_drop_output(client);
+        close(client->fd);
+        free(client->rbuf);
+        free(client);
+        worker_active--;
+    }
+}
 
-    for (int i = 0; i < array_length; i++) {
-        struct json_object *data_json = json_object_array_get_idx(data_array, i);
+static void client_yield(client_t *client) {
+    coro_transfer(&client->ctx, &client->main_ctx);
+}
 
-        /* Convert JSON object to string */
-        const char *json_str = json_object_to_json_string(data_json);
+static void pg_io_cb(struct ev_loop *loop, struct ev_io *watcher, int revents) {
+    client_t *client = (client_t *) watcher->data;
+    client->pg_revents = revents;
+    client_resume(client);
+}
 
-        /* Construct SQL query for insertion into jsonb column */
-        char query[BUFFER_SIZE];
-        snprintf(query, sizeof(query), "INSERT INTO %s (data) VALUES ('%s'::jsonb) RETURNING _id", table_name,
-                 json_str);
+static void client_timer_cb(struct ev_loop *loop, struct ev_timer *watcher, int revents) {
+    client_resume((client_t *) watcher->data);
+}
 
+/**
+ * suspends current client until the socket of conn is ready for events
+ * return events the socket is ready for
+ */
+static int client_wait_socket(PGconn *conn, int events) {
+    struct ev_loop *loop = ev_default_loop(0);
+    client_t *client = current_client;
+
+    /* outside a coroutine there is nothing to switch to, so just wait for the socket */
+    if (client == NULL) {
+        struct pollfd pfd = {.fd = PQsocket(conn), .events = 0};
+        pfd.events |= (events & EV_READ) ? POLLIN : 0;
+        pfd.events |= (events & EV_WRITE) ? POLLOUT : 0;
+        poll(&pfd, 1, -1);
+        return ((pfd.revents & (POLLIN | POLLERR | POLLHUP)) ? EV_READ : 0) | ((pfd.revents & POLLOUT) ? EV_WRITE : 0);
+    }
 
-        PGresult *res = PQexec(conn, query);
-        if (PQresultStatus(res) != PGRES_TUPLES_OK) {
-            fprintf(stderr, "INSERT command failed: %s", PQerrorMessage(conn));
-            PQclear(res);
-            return false;
-        }
+    ev_io_init(&client->pg_io, pg_io_cb, PQsocket(conn), events);
+    client->pg_io.data = client;
+    client->pg_revents = 0;
+    ev_io_start(loop, &client->pg_io);
+    client_yield(client);
+    ev_io_stop(loop, &client->pg_io);
 
-        (*inserted_count)++;
-        PQclear(res);
-    }
-    return true;
+    return client->pg_revents;
 }
 
-/* Connects to database, creates it and required table if they don't exist,
-   and executes insert queries for given data array.
-   Returns true if operation was successful, false otherwise. */
-bool execute_query_insert_to_postgres(const char *json_metadata, const char *json_data_array, int *inserted_count) {
+/* suspends current client for the given number of seconds */
+static void client_sleep(ev_tstamp seconds) {
+    struct ev_loop *loop = ev_default_loop(0);
+    client_t *client = current_client;
 
-    /* Connect to initial database */
-    PGconn *conn = PQconnectdb(PG_CONNINFO);
-    if (PQstatus(conn) != CONNECTION_OK) {
-        fprintf(stderr, "Connection to database failed: %s", PQerrorMessage(conn));
-        PQfinish(conn);
-        return false;
-    }
+    ev_timer_init(&client->timer, client_timer_cb, seconds, 0);
+    client->timer.data = client;
+    ev_timer_start(loop, &client->timer);
+    client_yield(client);
+}
 
-    /* Parse metadata JSON */
-    struct json_object *metadata_json = json_tokener_parse(json_metadata);
-    if (!metadata_json) {
-        fprintf(stderr, "Failed to parse metadata JSON\n");
-        PQfinish(conn);
-        return false;
-    }
+/*
+ * worker-resident cache of existing tables, so commands do not run CREATE TABLE IF NOT EXISTS in steady state.
+ * entries are found by name on every access: a query suspends the client and the cache can be invalidated meanwhile
+ */
+static schema_db_t **schema_dbs = NULL;
+static int schema_dbs_count = 0;
 
-    struct json_object *insert_obj, *db_obj;
-    if (!json_object_object_get_ex(metadata_json, "insert", &insert_obj) ||
-        !json_object_object_get_ex(metadata_json, "$db", &db_obj)) {
-        fprintf(stderr, "Invalid metadata JSON format\n");
-        json_object_put(metadata_json);
-        PQfinish(conn);
-        return false;
-    }
+/* SQLSTATE of the last failed SPI command, results made from SPI have no error fields */
+static char spi_last_sqlstate[6] = "";
 
-    const char *collection = json_object_get_string(insert_obj);
-    const char *dbname = json_object_get_string(db_obj);
+static schema_db_t *schema_db_of(PGconn *conn) {
+    const char *dbname = conn == NULL ? proxy_database : PQdb(conn);
 
-    /* Check and create database if it does not exist */
-    if (!check_and_create_database(conn, dbname)) {
-        fprintf(stderr, "Failed to create or check database\n");
-        json_object_put(metadata_json);
-        PQfinish(conn);
-        return false;
+    for (int i = 0; i < schema_dbs_count; i++) {
+        if (strcmp(schema_dbs[i]->dbname, dbname) == 0) {
+            return schema_dbs[i];
+        }
     }
 
-    PQfinish(conn);
+    schema_dbs = (schema_db_t **) realloc(schema_dbs, sizeof(schema_db_t *) * (schema_dbs_count + 1));
+    schema_db_t *db = (schema_db_t *) calloc(1, sizeof(schema_db_t));
+    snprintf(db->dbname, sizeof(db->dbname), "%s", dbname);
+    schema_dbs[schema_dbs_count++] = db;
+    return db;
+}
 
-    /* Connect to specified database */
-    char conninfo[BUFFER_SIZE];
-    snprintf(conninfo, sizeof(conninfo), "dbname=%s user=user1 password=passwd port=5433", dbname);
-    conn = PQconnectdb(conninfo);
-    if (PQstatus(conn) != CONNECTION_OK) {
-        fprintf(stderr, "Connection to database %s failed: %s", dbname, PQerrorMessage(conn));
-        json_object_put(metadata_json);
-        PQfinish(conn);
-        return false;
+static schema_table_t *schema_table_find(schema_db_t *db, const char *table_name) {
+    for (int i = 0; i < db->n_tables; i++) {
+        if (strcmp(db->tables[i].name, table_name) == 0) {
+            return &db->tables[i];
+        }
     }
+    return NULL;
+}
 
-    /* Check and create table if it does not exist */
-    if (!check_and_create_table(conn, collection)) {
-        fprintf(stderr, "Failed to create or check table\n");
-        json_object_put(metadata_json);
-        PQfinish(conn);
-        return false;
-    }
+/* forgets all tables of the database of conn, they are loaded again on next use */
+void schema_invalidate(PGconn *conn) {
+    schema_db_t *db = schema_db_of(conn);
+    db->n_tables = 0;
+}
 
-    /* Parse data JSON array */
-    struct json_object *data_array = json_tokener_parse(json_data_array);
-    if (!data_array || json_object_get_type(data_array) != json_type_array) {
-        fprintf(stderr, "Failed to parse data JSON array\n");
-        json_object_put(metadata_json);
-        PQfinish(conn);
-        return false;
+const char *proxy_result_sqlstate(PGconn *conn, const PGresult *res) {
+    if (PQresultStatus(res) != PGRES_FATAL_ERROR) {
+        return NULL;
     }
+    return conn == NULL ? spi_last_sqlstate : PQresultErrorField(res, PG_DIAG_SQLSTATE);
+}
 
-    /* Execute insert queries */
-    if (!execute_insert_queries(conn, collection, data_array, inserted_count)) {
-        fprintf(stderr, "Failed to execute insert queries\n");
-        json_object_put(metadata_json);
-        json_object_put(data_array);
-        PQfinish(conn);
-        return false;
+/**
+ * drops cached schema of the database when a command failed because of it:
+ * class 42 covers undefined_table of a table dropped behind the proxy and failed DDL
+ */
+static void schema_check_error(PGconn *conn, const PGresult *res) {
+    const char *sqlstate = proxy_result_sqlstate(conn, res);
+    if (sqlstate != NULL && strncmp(sqlstate, "42", 2) == 0) {
+        schema_invalidate(conn);
     }
+}
+
+/* return true if the table was created or checked by this worker recently */
+bool schema_table_known(PGconn *conn, const char *table_name) {
+    schema_table_t *table = schema_table_find(schema_db_of(conn), table_name);
+    return table != NULL && ev_now(ev_default_loop(0)) - table->checked_at < SCHEMA_REFRESH_INTERVAL;
+}
 
-    /* Clean up */
-    json_object_put(metadata_json);
-    json_object_put(data_array);
-    PQfinish(conn);
+void schema_table_add(PGconn *conn, const char *table_name) {
+    schema_db_t *db = schema_db_of(conn);
+    schema_table_t *table = schema_table_find(db, table_name);
 
-    return true;
+    if (table == NULL) {
+        if (db->n_tables == db->tables_capacity) {
+            db->tables_capacity = db->tables_capacity == 0 ? 16 : db->tables_capacity * 2;
+            db->tables = (schema_table_t *) realloc(db->tables, sizeof(schema_table_t) * db->tables_capacity);
+        }
+        table = &db->tables[db->n_tables++];
+        snprintf(table->name, sizeof(table->name), "%s", table_name);
+    }
+    table->checked_at = ev_now(ev_default_loop(0));
 }
 
-/* Executes delete queries for each JSON object in delete array from specified table.
-   Updates deleted count and returns true if all deletes were successful, false otherwise. */
-bool
-execute_delete_queries(PGconn *conn, const char *table_name, struct json_object *delete_array, int *deleted_count) {
-    int array_length = json_object_array_length(delete_array);
-    *deleted_count = 0;
+/**
+ * connects to database without blocking the event loop when called from a client coroutine
+ * return connection that must be checked with PQstatus
+ */
+PGconn *proxy_connect(const char *conninfo) {
+    if (current_client == NULL) {
+        return PQconnectdb(conninfo);
+    }
 
-    for (int i = 0; i < array_length; i++) {
-        struct json_object *delete_json = json_object_array_get_idx(delete_array, i);
-        struct json_object *q_json, *limit_json;
+    PGconn *conn = PQconnectStart(conninfo);
+    PostgresPollingStatusType poll_status = PGRES_POLLING_WRITING;
+    while (conn != NULL && PQstatus(conn) != CONNECTION_BAD &&
+           poll_status != PGRES_POLLING_OK && poll_status != PGRES_POLLING_FAILED) {
+        client_wait_socket(conn, poll_status == PGRES_POLLING_READING ? EV_READ : EV_WRITE);
+        poll_status = PQconnectPoll(conn);
+    }
+    return conn;
+}
 
-        /* Validate delete JSON format */
-        if (!json_object_object_get_ex(delete_json, "q", &q_json) ||
-            !json_object_object_get_ex(delete_json, "limit", &limit_json)) {
-            fprintf(stderr, "Invalid delete JSON format\n");
+/* sends everything libpq has buffered for the server */
+static bool proxy_flush(PGconn *conn) {
+    int flushed;
+    while ((flushed = PQflush(conn)) == 1) {
+        if ((client_wait_socket(conn, EV_READ | EV_WRITE) & EV_READ) && !PQconsumeInput(conn)) {
             return false;
         }
+    }
+    return flushed == 0;
+}
 
-        const char *q_str = json_object_to_json_string_ext(q_json, JSON_C_TO_STRING_PLAIN);
-        int limit = json_object_get_int(limit_json);
-
-        /* Construct JSONPath condition dynamically */
-        char jsonpath_condition[BUFFER_SIZE] = "$.** ? (";
-        json_object_object_foreach(q_json, key, val)
-        {
-            char condition_part[BUFFER_SIZE];
-            snprintf(condition_part, sizeof(condition_part), "@.%s == \"%s\" && ", key, json_object_get_string(val));
-            strncat(jsonpath_condition, condition_part, sizeof(jsonpath_condition) - strlen(jsonpath_condition) - 1);
+/* suspends current client until libpq has a whole result, so PQgetResult does not block */
+static bool proxy_wait_result(PGconn *conn) {
+    while (PQisBusy(conn)) {
+        client_wait_socket(conn, EV_READ);
+        if (!PQconsumeInput(conn)) {
+            return false;
         }
+    }
+    return true;
+}
 
-        /* Remove trailing " && " and close condition */
-        jsonpath_condition[strlen(jsonpath_condition) - 4] = '\0';
-        strncat(jsonpath_condition, ")", sizeof(jsonpath_condition) - strlen(jsonpath_condition) - 1);
+/**
+ * collects results of the sent query like PQexec does:
+ * returns the last result, or the first error if there was one
+ */
+static PGresult *proxy_get_last_result(PGconn *conn) {
+    PGresult *last = NULL;
+    PGresult *res;
 
-        /* Construct full query string */
-        char query[BUFFER_SIZE];
-        if (limit == 0) {
-            snprintf(query, sizeof(query), "DELETE FROM %s WHERE jsonb_path_exists(data, '%s')", table_name,
-                     jsonpath_condition);
-        } else {
-            snprintf(query, sizeof(query),
-                     "WITH del AS (SELECT ctid FROM %s WHERE jsonb_path_exists(data, '%s') LIMIT %d) "
-                     "DELETE FROM %s WHERE ctid IN (SELECT ctid FROM del)",
-                     table_name, jsonpath_condition, limit, table_name);
-        }
+    if (!proxy_flush(conn)) {
+        return PQmakeEmptyPGresult(conn, PGRES_FATAL_ERROR);
+    }
 
-        PGresult *res = PQexec(conn, query);
-        if (PQresultStatus(res) != PGRES_COMMAND_OK) {
-            fprintf(stderr, "DELETE command failed: %s", PQerrorMessage(conn));
+    while (proxy_wait_result(conn) && (res = PQgetResult(conn)) != NULL) {
+        if (last != NULL && PQresultStatus(last) == PGRES_FATAL_ERROR) {
             PQclear(res);
-            return false;
+            continue;
+        }
+        PQclear(last);
+        last = res;
+        if (PQresultStatus(res) == PGRES_COPY_IN || PQresultStatus(res) == PGRES_COPY_OUT) {
+            break;
         }
+    }
 
-        *deleted_count += atoi(PQcmdTuples(res));
-        PQclear(res);
+    if (last == NULL) {
+        last = PQmakeEmptyPGresult(conn, PGRES_FATAL_ERROR);
     }
-    return true;
+    schema_check_error(conn, last);
+    return last;
 }
 
-/* Connects to database, checks and creates the required table if it doesn't exist,
-   and executes delete queries for given data array.
-   Returns true if operation was successful, false otherwise. */
-bool execute_query_delete_to_postgres(const char *json_metadata, const char *json_data_array, int *deleted_count) {
-    elog(WARNING, "line: %d", __LINE__);
-    /* Connect to initial database */
-    PGconn *conn = PQconnectdb(PG_CONNINFO);
-    elog(WARNING, "line: %d", __LINE__);
-    if (PQstatus(conn) != CONNECTION_OK) {
-        elog(WARNING, "line: %d", __LINE__);
-        fprintf(stderr, "Connection to database failed: %s", PQerrorMessage(conn));
-        PQfinish(conn);
-        return false;
-    }
-    elog(WARNING, "line: %d", __LINE__);
-    /* Parse metadata JSON */
-    struct json_object *metadata_json = json_tokener_parse(json_metadata);
-    if (!metadata_json) {
-        fprintf(stderr, "Failed to parse metadata JSON\n");
-        PQfinish(conn);
-        return false;
+/**
+ * appends placeholder of the next parameter to buf and keeps a copy of value
+ * NULL value is passed as SQL NULL
+ */
+void query_add_param(query_params_t *params, char *buf, size_t buf_size, const char *value) {
+    if (params->count == params->capacity) {
+        params->capacity = params->capacity == 0 ? 8 : params->capacity * 2;
+        params->values = (char **) realloc(params->values, sizeof(char *) * params->capacity);
     }
-    elog(WARNING, "line: %d", __LINE__);
+    params->values[params->count++] = value == NULL ? NULL : strdup(value);
+    snprintf(buf + strlen(buf), buf_size - strlen(buf), "$%d", params->count);
+}
 
-    struct json_object *delete_obj, *db_obj;
-    if (!json_object_object_get_ex(metadata_json, "delete", &delete_obj) ||
-        !json_object_object_get_ex(metadata_json, "$db", &db_obj)) {
-        fprintf(stderr, "Invalid metadata JSON format\n");
-        json_object_put(metadata_json);
-        PQfinish(conn);
-        return false;
+void query_params_free(query_params_t *params) {
+    for (int i = 0; i < params->count; i++) {
+        free(params->values[i]);
     }
+    free(params->values);
+    params->values = NULL;
+    params->count = 0;
+    params->capacity = 0;
+}
 
-    const char *collection = json_object_get_string(delete_obj);
-    const char *dbname = json_object_get_string(db_obj);
+/* statements cached for the SPI backend, the worker's backend is shared by all clients */
+static stmt_cache_t spi_stmt_cache;
 
-    /* Check and create database if it does not exist */
-    if (!check_and_create_database(conn, dbname)) {
-        fprintf(stderr, "Failed to create or check database\n");
-        json_object_put(metadata_json);
-        PQfinish(conn);
-        return false;
+static uint32 stmt_hash(const char *query) {
+    uint32 hash = 2166136261u;
+    for (const char *c = query; *c != '\0'; c++) {
+        hash = (hash ^ (unsigned char) *c) * 16777619u;
+    }
+    return hash;
+}
+
+/* frees the statement cache of a connection when the connection is closed with PQfinish */
+static int stmt_cache_event_proc(PGEventId evt_id, void *evt_info, void *pass_through) {
+    if (evt_id == PGEVT_CONNDESTROY) {
+        PGconn *conn = ((PGEventConnDestroy *) evt_info)->conn;
+        stmt_cache_t *cache = (stmt_cache_t *) PQinstanceData(conn, stmt_cache_event_proc);
+        if (cache != NULL) {
+            for (int i = 0; i < STMT_CACHE_SIZE; i++) {
+                free(cache->stmts[i].query);
+            }
+            free(cache);
+        }
+    }
+    return 1;
+}
+
+/* attaches an empty statement cache to a new connection */
+static bool stmt_cache_attach(PGconn *conn) {
+    stmt_cache_t *cache = (stmt_cache_t *) calloc(1, sizeof(stmt_cache_t));
+    if (!PQregisterEventProc(conn, stmt_cache_event_proc, "pg_proxy statement cache", NULL) ||
+        !PQsetInstanceData(conn, stmt_cache_event_proc, cache)) {
+        free(cache);
+        return false;
+    }
+    return true;
+}
+
+static void spi_parser_setup(struct ParseState *pstate, void *arg) {
+    spi_param_types_t *types = (spi_param_types_t *) arg;
+    setup_parse_variable_parameters(pstate, &types->types, &types->count);
+}
+
+/**
+ * prepares query for SPI, parameter types are inferred from the query like the server does for libpq clients
+ * must be called after SPI_connect, the plan is freed by SPI_finish unless SPI_keepplan is called for it
+ */
+static SPIPlanPtr spi_prepare(const char *query) {
+    spi_param_types_t types = {NULL, 0};
+
+    /* the first parse only infers types of the parameters, the plan is made with the fixed ones */
+    if (SPI_prepare_params(query, spi_parser_setup, &types, 0) == NULL) {
+        elog(ERROR, "SPI_prepare_params failed: %s", SPI_result_code_string(SPI_result));
+    }
+    for (int i = 0; i < types.count; i++) {
+        if (types.types[i] == InvalidOid || types.types[i] == UNKNOWNOID) {
+            types.types[i] = TEXTOID;
+        }
+    }
+
+    SPIPlanPtr plan = SPI_prepare(query, types.count, types.types);
+    if (plan == NULL) {
+        elog(ERROR, "SPI_prepare failed: %s", SPI_result_code_string(SPI_result));
+    }
+    return plan;
+}
+
+/**
+ * removes statement from the cache, the prepared statement is deallocated on the server
+ * SPI plans must be freed inside spi_exec
+ */
+static void stmt_cache_evict(PGconn *conn, cached_stmt_t *stmt) {
+    if (stmt->query == NULL) {
+        return;
+    }
+
+    if (conn == NULL) {
+        SPI_freeplan(stmt->plan);
+        stmt->plan = NULL;
+    } else {
+        char query[NAMEDATALEN + 16];
+        snprintf(query, sizeof(query), "DEALLOCATE %s", stmt->name);
+        PQclear(proxy_exec(conn, query));
+    }
+
+    free(stmt->query);
+    stmt->query = NULL;
+    stmt->last_used = 0;
+}
+
+static bool stmt_prepare(PGconn *conn, cached_stmt_t *stmt, const char *query, uint64 id) {
+    PGresult *res;
+
+    snprintf(stmt->name, sizeof(stmt->name), "pg_proxy_%llu", (unsigned long long) id);
+    if (conn == NULL) {
+        stmt->plan = spi_prepare(query);
+        return SPI_keepplan(stmt->plan) == 0;
+    }
+
+    /* no parameter types are given, the server infers them from the query */
+    if (current_client == NULL) {
+        res = PQprepare(conn, stmt->name, query, 0, NULL);
+    } else if (!PQsendPrepare(conn, stmt->name, query, 0, NULL)) {
+        return false;
+    } else {
+        res = proxy_get_last_result(conn);
+    }
+
+    bool ok = PQresultStatus(res) == PGRES_COMMAND_OK;
+    if (!ok) {
+        fprintf(stderr, "PREPARE failed: %s", PQresultErrorMessage(res));
+    }
+    PQclear(res);
+    return ok;
+}
+
+/**
+ * finds statement prepared for query in the cache, preparing it on a cache miss.
+ * statements used after pinned_since are not evicted, they are queued in the same pipeline
+ * return NULL if the statement can not be cached, then the query is executed unprepared
+ */
+static cached_stmt_t *stmt_cache_get(PGconn *conn, stmt_cache_t *cache, const char *query, uint64 pinned_since) {
+    uint32 hash = stmt_hash(query);
+    cached_stmt_t *victim = NULL;
+
+    for (int i = 0; i < STMT_CACHE_SIZE; i++) {
+        cached_stmt_t *stmt = &cache->stmts[i];
+        if (stmt->query != NULL && stmt->hash == hash && strcmp(stmt->query, query) == 0) {
+            stmt->last_used = ++cache->clock;
+            return stmt;
+        }
+        /* empty slots have last_used 0, so they are taken before any statement is evicted */
+        if (stmt->last_used <= pinned_since && (victim == NULL || stmt->last_used < victim->last_used)) {
+            victim = stmt;
+        }
+    }
+
+    if (victim == NULL) {
+        return NULL;
+    }
+    stmt_cache_evict(conn, victim);
+    if (!stmt_prepare(conn, victim, query, ++cache->next_id)) {
+        return NULL;
+    }
+    victim->query = strdup(query);
+    victim->hash = hash;
+    victim->result_format = -1;
+    victim->last_used = ++cache->clock;
+    return victim;
+}
+
+static PGresult *proxy_exec_prepared(PGconn *conn, const char *name, const query_params_t *params,
+                                     int result_format) {
+    const char *const *values = (const char *const *) params->values;
+
+    if (current_client == NULL) {
+        return PQexecPrepared(conn, name, params->count, values, NULL, NULL, result_format);
+    }
+
+    if (!PQsendQueryPrepared(conn, name, params->count, values, NULL, NULL, result_format)) {
+        return PQmakeEmptyPGresult(conn, PGRES_FATAL_ERROR);
+    }
+    return proxy_get_last_result(conn);
+}
+
+/**
+ * copies result of the last SPI command to a PGresult, so the callers work with both backends the same way
+ * must be called before SPI_finish
+ */
+static PGresult *spi_make_result(bool binary) {
+    if (SPI_tuptable == NULL) {
+        return PQmakeEmptyPGresult(NULL, PGRES_COMMAND_OK);
+    }
+
+    TupleDesc tupdesc = SPI_tuptable->tupdesc;
+    PGresult *res = PQmakeEmptyPGresult(NULL, PGRES_TUPLES_OK);
+    PGresAttDesc *attrs = (PGresAttDesc *) palloc0(sizeof(PGresAttDesc) * Max(tupdesc->natts, 1));
+    Oid *typsend = (Oid *) palloc0(sizeof(Oid) * Max(tupdesc->natts, 1));
+
+    for (int i = 0; i < tupdesc->natts; i++) {
+        Form_pg_attribute attr = TupleDescAttr(tupdesc, i);
+        attrs[i].name = NameStr(attr->attname);
+        attrs[i].typid = attr->atttypid;
+        attrs[i].typlen = attr->attlen;
+        attrs[i].atttypmod = attr->atttypmod;
+        /* unlike the protocol the result can mix formats, so only columns of unsupported types stay text */
+        attrs[i].format = binary && pg_binary_type_supported(attr->atttypid) ? 1 : 0;
+        if (attrs[i].format == 1) {
+            bool typisvarlena;
+            getTypeBinaryOutputInfo(attr->atttypid, &typsend[i], &typisvarlena);
+        }
+    }
+    PQsetResultAttrs(res, tupdesc->natts, attrs);
+
+    for (uint64 row = 0; row < SPI_processed; row++) {
+        for (int col = 0; col < tupdesc->natts; col++) {
+            if (attrs[col].format == 1) {
+                bool isnull;
+                Datum datum = SPI_getbinval(SPI_tuptable->vals[row], tupdesc, col + 1, &isnull);
+                bytea *value = isnull ? NULL : OidSendFunctionCall(typsend[col], datum);
+                PQsetvalue(res, (int) row, col, value == NULL ? NULL : VARDATA(value),
+                           value == NULL ? -1 : (int) (VARSIZE(value) - VARHDRSZ));
+                continue;
+            }
+            char *value = SPI_getvalue(SPI_tuptable->vals[row], tupdesc, col + 1);
+            PQsetvalue(res, (int) row, col, value, value == NULL ? -1 : (int) strlen(value));
+        }
+    }
+    return res;
+}
+
+/**
+ * executes query with text parameters inside the worker's own backend, in a transaction of its own like
+ * autocommit statement sent with libpq. the plan is kept in spi_stmt_cache if cached is true,
+ * with binary the columns of types supported by pg_binary_type_supported are returned in binary format.
+ * rows processed by the query are stored to *processed
+ * return result converted by spi_make_result, or PGRES_FATAL_ERROR result if the query failed
+ */
+static PGresult *spi_exec(const char *query, const query_params_t *params, bool cached, bool binary,
+                          uint64 *processed) {
+    MemoryContext oldcontext = CurrentMemoryContext;
+    /* the query runs on the client coroutine stack, so stack depth is checked against it, not the worker stack */
+    pg_stack_base_t stack_base = set_stack_base();
+    PGresult *volatile res = NULL;
+
+    *processed = 0;
+    SetCurrentStatementStartTimestamp();
+    StartTransactionCommand();
+    PG_TRY();
+    {
+        SPI_connect();
+        PushActiveSnapshot(GetTransactionSnapshot());
+
+        cached_stmt_t *stmt = cached ? stmt_cache_get(NULL, &spi_stmt_cache, query, spi_stmt_cache.clock) : NULL;
+        SPIPlanPtr plan = stmt != NULL ? stmt->plan : spi_prepare(query);
+
+        /* parameters come as text like with libpq, they are converted with input functions of inferred types */
+        int n_args = SPI_getargcount(plan);
+        Datum *values = (Datum *) palloc(sizeof(Datum) * Max(n_args, 1));
+        char *nulls = (char *) palloc(Max(n_args, 1));
+        for (int i = 0; i < n_args; i++) {
+            char *value = params != NULL && i < params->count ? params->values[i] : NULL;
+            Oid typinput, typioparam;
+
+            getTypeInputInfo(SPI_getargtypeid(plan, i), &typinput, &typioparam);
+            values[i] = OidInputFunctionCall(typinput, value, typioparam, -1);
+            nulls[i] = value == NULL ? 'n' : ' ';
+        }
+
+        int ret = SPI_execute_plan(plan, values, nulls, false, 0);
+        if (ret < 0) {
+            elog(ERROR, "SPI_execute_plan failed: %s", SPI_result_code_string(ret));
+        }
+        *processed = SPI_processed;
+        res = spi_make_result(binary);
+
+        PopActiveSnapshot();
+        SPI_finish();
+        CommitTransactionCommand();
+    }
+    PG_CATCH();
+    {
+        MemoryContextSwitchTo(oldcontext);
+        ErrorData *edata = CopyErrorData();
+        FlushErrorState();
+        AbortCurrentTransaction();
+
+        elog(WARNING, "pg_proxy: SPI command failed: %s", edata->message);
+        snprintf(spi_last_sqlstate, sizeof(spi_last_sqlstate), "%s", unpack_sql_state(edata->sqlerrcode));
+        FreeErrorData(edata);
+
+        PQclear(res);
+        res = PQmakeEmptyPGresult(NULL, PGRES_FATAL_ERROR);
+        schema_check_error(NULL, res);
+    }
+    PG_END_TRY();
+
+    MemoryContextSwitchTo(oldcontext);
+    restore_stack_base(stack_base);
+    return res;
+}
+
+/**
+ * PQexec replacement: from a client coroutine the query is sent with PQsendQuery
+ * and the client is suspended until the result arrives, other clients are served meanwhile
+ */
+PGresult *proxy_exec(PGconn *conn, const char *query) {
+    uint64 processed;
+
+    if (conn == NULL) {
+        return spi_exec(query, NULL, false, false, &processed);
+    }
+    if (current_client == NULL) {
+        return PQexec(conn, query);
+    }
+
+    if (!PQsendQuery(conn, query)) {
+        return PQmakeEmptyPGresult(conn, PGRES_FATAL_ERROR);
+    }
+    return proxy_get_last_result(conn);
+}
+
+/* PQexecParams replacement with text parameters and text results, see proxy_exec */
+PGresult *proxy_exec_params(PGconn *conn, const char *query, int n_params, const char *const *param_values) {
+    uint64 processed;
+    query_params_t params = {n_params, n_params, (char **) param_values};
+
+    if (conn == NULL) {
+        return spi_exec(query, &params, false, false, &processed);
+    }
+    if (current_client == NULL) {
+        return PQexecParams(conn, query, n_params, NULL, param_values, NULL, NULL, 0);
+    }
+
+    if (!PQsendQueryParams(conn, query, n_params, NULL, param_values, NULL, NULL, 0)) {
+        return PQmakeEmptyPGresult(conn, PGRES_FATAL_ERROR);
+    }
+    return proxy_get_last_result(conn);
+}
+
+/**
+ * the protocol has one result format for all columns, so binary results are asked for only
+ * if every column of the statement has a type supported by pg_binary_type_supported.
+ * the statement is described once, when it is used with binary results for the first time
+ */
+static int stmt_result_format(PGconn *conn, cached_stmt_t *stmt) {
+    if (stmt->result_format < 0) {
+        PGresult *res = NULL;
+        if (current_client == NULL) {
+            res = PQdescribePrepared(conn, stmt->name);
+        } else if (PQsendDescribePrepared(conn, stmt->name)) {
+            res = proxy_get_last_result(conn);
+        }
+
+        stmt->result_format = res != NULL && PQresultStatus(res) == PGRES_COMMAND_OK ? 1 : 0;
+        for (int i = 0; stmt->result_format == 1 && i < PQnfields(res); i++) {
+            if (!pg_binary_type_supported(PQftype(res, i))) {
+                stmt->result_format = 0;
+            }
+        }
+        PQclear(res);
+    }
+    return stmt->result_format;
+}
+
+/**
+ * executes query built by a translator as a statement prepared once per connection and query shape,
+ * so PostgreSQL does not parse and plan hot queries again. results are in text format like with proxy_exec,
+ * with binary they are in binary format when all of their columns can be decoded, see PQfformat
+ */
+PGresult *proxy_exec_cached(PGconn *conn, const char *query, const query_params_t *params, bool binary) {
+    uint64 processed;
+
+    if (conn == NULL) {
+        return spi_exec(query, params, true, binary, &processed);
+    }
+
+    stmt_cache_t *cache = (stmt_cache_t *) PQinstanceData(conn, stmt_cache_event_proc);
+    cached_stmt_t *stmt = cache == NULL ? NULL : stmt_cache_get(conn, cache, query, cache->clock);
+    if (stmt == NULL) {
+        return proxy_exec_params(conn, query, params->count, (const char *const *) params->values);
+    }
+
+    PGresult *res = proxy_exec_prepared(conn, stmt->name, params, binary ? stmt_result_format(conn, stmt) : 0);
+
+    /* SELECT * prepared before a column was added to the table can not be executed any more, prepare it again */
+    const char *sqlstate = PQresultErrorField(res, PG_DIAG_SQLSTATE);
+    if (sqlstate != NULL && strcmp(sqlstate, "0A000") == 0) {
+        PQclear(res);
+        stmt_cache_evict(conn, stmt);
+        stmt = stmt_cache_get(conn, cache, query, cache->clock);
+        if (stmt == NULL) {
+            return proxy_exec_params(conn, query, params->count, (const char *const *) params->values);
+        }
+        res = proxy_exec_prepared(conn, stmt->name, params, binary ? stmt_result_format(conn, stmt) : 0);
+    }
+    return res;
+}
+
+/* sends query of the stream and switches the connection to single-row mode before anything is read */
+static bool proxy_stream_send(proxy_stream_t *stream) {
+    PGconn *conn = stream->conn;
+    stmt_cache_t *cache = (stmt_cache_t *) PQinstanceData(conn, stmt_cache_event_proc);
+    const char *const *values = (const char *const *) stream->params->values;
+    int queued;
+
+    stream->stmt = cache == NULL ? NULL : stmt_cache_get(conn, cache, stream->query, cache->clock);
+    if (stream->stmt != NULL) {
+        int result_format = stream->binary ? stmt_result_format(conn, stream->stmt) : 0;
+        queued = PQsendQueryPrepared(conn, stream->stmt->name, stream->params->count, values, NULL, NULL,
+                                     result_format);
+    } else {
+        queued = PQsendQueryParams(conn, stream->query, stream->params->count, NULL, values, NULL, NULL, 0);
+    }
+
+    if (!queued || !PQsetSingleRowMode(conn) || !proxy_flush(conn)) {
+        fprintf(stderr, "Failed to send query: %s", PQerrorMessage(conn));
+        return false;
+    }
+    return true;
+}
+
+/**
+ * starts query whose rows are read with proxy_stream_next as they arrive, so rows of a large result
+ * are never collected in one PGresult. statements are prepared and cached like with proxy_exec_cached.
+ * query and params must stay valid until the stream is closed with proxy_stream_close
+ */
+bool proxy_stream_begin(proxy_stream_t *stream, PGconn *conn, const char *query, const query_params_t *params,
+                        bool binary) {
+    uint64 processed;
+
+    memset(stream, 0, sizeof(*stream));
+    stream->conn = conn;
+    stream->query = query;
+    stream->params = params;
+    stream->binary = binary;
+
+    if (conn == NULL) {
+        stream->spi_result = spi_exec(query, params, true, binary, &processed);
+        return true;
+    }
+    if (!proxy_stream_send(stream)) {
+        stream->done = true;
+        return false;
+    }
+    return true;
+}
+
+/**
+ * returns next chunk of rows: PGRES_SINGLE_TUPLE result with one row, or the whole PGRES_TUPLES_OK result with SPI.
+ * an error is returned as PGRES_FATAL_ERROR result, the stream is over after it
+ * return NULL when all rows were read
+ */
+PGresult *proxy_stream_next(proxy_stream_t *stream) {
+    PGconn *conn = stream->conn;
+    PGresult *res;
+
+    if (stream->done) {
+        return NULL;
+    }
+    if (conn == NULL) {
+        res = stream->spi_result;
+        stream->spi_result = NULL;
+        stream->done = true;
+        return res;
+    }
+
+    for (;;) {
+        if (!proxy_wait_result(conn)) {
+            stream->done = true;
+            return PQmakeEmptyPGresult(conn, PGRES_FATAL_ERROR);
+        }
+        res = PQgetResult(conn);
+        if (res == NULL) {
+            stream->done = true;
+            return NULL;
+        }
+
+        ExecStatusType status = PQresultStatus(res);
+        if (status == PGRES_SINGLE_TUPLE || (status == PGRES_TUPLES_OK && PQntuples(res) > 0)) {
+            stream->rows += PQntuples(res);
+            return res;
+        }
+        if (status == PGRES_TUPLES_OK) {
+            /* empty result follows the last row in single-row mode */
+            PQclear(res);
+            continue;
+        }
+
+        /* the rest of results is dropped, so the connection is ready for the next query */
+        PGresult *rest;
+        while (proxy_wait_result(conn) && (rest = PQgetResult(conn)) != NULL) {
+            PQclear(rest);
+        }
+        schema_check_error(conn, res);
+
+        /* SELECT * prepared before a column was added to the table can not be executed any more, prepare it again */
+        const char *sqlstate = PQresultErrorField(res, PG_DIAG_SQLSTATE);
+        if (stream->stmt != NULL && stream->rows == 0 && !stream->retried && sqlstate != NULL &&
+            strcmp(sqlstate, "0A000") == 0) {
+            PQclear(res);
+            stmt_cache_evict(conn, stream->stmt);
+            stream->retried = true;
+            if (proxy_stream_send(stream)) {
+                continue;
+            }
+            res = PQmakeEmptyPGresult(conn, PGRES_FATAL_ERROR);
+        }
+        stream->done = true;
+        return res;
+    }
+}
+
+/* reads and drops rows left in the stream, so the connection can run the next query */
+void proxy_stream_close(proxy_stream_t *stream) {
+    PGresult *res;
+    while ((res = proxy_stream_next(stream)) != NULL) {
+        PQclear(res);
+    }
+}
+
+/**
+ * reads results of the next statement queued by proxy_exec_pipeline up to its sync point
+ * return false if the statement failed or the connection is broken
+ */
+static bool proxy_pipeline_next(PGconn *conn, int n_stmts, int *affected) {
+    bool ok = true;
+    PGresult *res;
+
+    /* results of every statement end with NULL, then the sync point gives PGRES_PIPELINE_SYNC */
+    for (int i = 0; i < n_stmts;) {
+        if (!proxy_wait_result(conn)) {
+            return false;
+        }
+        if ((res = PQgetResult(conn)) == NULL) {
+            i++;
+            continue;
+        }
+        ExecStatusType status = PQresultStatus(res);
+        if (status == PGRES_COMMAND_OK || status == PGRES_TUPLES_OK) {
+            *affected += atoi(PQcmdTuples(res));
+        } else if (status == PGRES_PIPELINE_ABORTED) {
+            /* statement after a failed one in the same transaction was skipped */
+            ok = false;
+        } else {
+            fprintf(stderr, "Pipelined command failed: %s", PQresultErrorMessage(res));
+            schema_check_error(conn, res);
+            ok = false;
+        }
+        PQclear(res);
+    }
+
+    if (!proxy_wait_result(conn) || (res = PQgetResult(conn)) == NULL) {
+        return false;
+    }
+    if (PQresultStatus(res) != PGRES_PIPELINE_SYNC) {
+        ok = false;
+    }
+    PQclear(res);
+    return ok;
+}
+
+/**
+ * executes statements of one command in libpq pipeline mode, so all of them cost one round trip.
+ * every statement is followed by its own sync point and commits on its own like with proxy_exec,
+ * so a failed statement does not roll back the others.
+ * with atomic the statements share one sync point instead and are one implicit transaction,
+ * with SPI they are still committed one by one.
+ * with cached statements are prepared once per connection and query shape, see proxy_exec_cached.
+ * rows changed by the statements that succeeded before the first failed one are added to *affected
+ * return true if all statements succeeded
+ */
+bool proxy_exec_pipeline(PGconn *conn, proxy_stmt_t *stmts, int n_stmts, bool cached, bool atomic, int *affected) {
+    int sent = 0;
+    bool ok = true;
+
+    if (n_stmts == 0) {
+        return true;
+    }
+
+    /* with SPI there is no round trip to save, statements are just executed one by one */
+    if (conn == NULL) {
+        for (int i = 0; i < n_stmts; i++) {
+            uint64 processed;
+            PGresult *res = spi_exec(stmts[i].query, &stmts[i].params, cached, false, &processed);
+            if (PQresultStatus(res) != PGRES_COMMAND_OK && PQresultStatus(res) != PGRES_TUPLES_OK) {
+                ok = false;
+            } else if (ok) {
+                *affected += (int) processed;
+            }
+            PQclear(res);
+        }
+        return ok;
+    }
+
+    /* statements missing in the cache are prepared before the pipeline, statements of this command stay in the cache */
+    stmt_cache_t *cache = cached ? (stmt_cache_t *) PQinstanceData(conn, stmt_cache_event_proc) : NULL;
+    cached_stmt_t **prepared = (cached_stmt_t **) calloc(n_stmts, sizeof(cached_stmt_t *));
+    if (cache != NULL) {
+        uint64 pinned_since = cache->clock;
+        for (int i = 0; i < n_stmts; i++) {
+            prepared[i] = stmt_cache_get(conn, cache, stmts[i].query, pinned_since);
+        }
+    }
+
+    if (!PQenterPipelineMode(conn)) {
+        fprintf(stderr, "Failed to enter pipeline mode: %s", PQerrorMessage(conn));
+        free(prepared);
+        return false;
+    }
+
+    for (; sent < n_stmts; sent++) {
+        const query_params_t *params = &stmts[sent].params;
+        const char *const *values = (const char *const *) params->values;
+        /* pipeline mode needs the extended query protocol, so PQsendQuery can not be used here */
+        int queued = prepared[sent] != NULL
+                     ? PQsendQueryPrepared(conn, prepared[sent]->name, params->count, values, NULL, NULL, 0)
+                     : PQsendQueryParams(conn, stmts[sent].query, params->count, NULL, values, NULL, NULL, 0);
+        if (!queued || ((!atomic || sent == n_stmts - 1) && !PQpipelineSync(conn))) {
+            fprintf(stderr, "Failed to queue command: %s", PQerrorMessage(conn));
+            ok = false;
+            break;
+        }
+    }
+    free(prepared);
+
+    /* without a sync point nothing of atomic statements is executed, pool_release closes the connection */
+    if (atomic && !ok) {
+        return false;
+    }
+
+    if (!proxy_flush(conn)) {
+        fprintf(stderr, "Failed to send pipeline: %s", PQerrorMessage(conn));
+        return false;
+    }
+
+    /* a statement that failed to be queued has no sync point, the loop stops at the previous one */
+    for (int i = 0; i < sent; i += atomic ? sent : 1) {
+        int changed = 0;
+        bool done = proxy_pipeline_next(conn, atomic ? sent : 1, &changed);
+        if (ok && done) {
+            *affected += changed;
+        }
+        ok = ok && done;
+        if (PQstatus(conn) != CONNECTION_OK) {
+            return false;
+        }
+    }
+
+    /* fails only if results are left unread, pool_release closes such connection */
+    PQexitPipelineMode(conn);
+    return ok;
+}
+
+/**
+ * starts COPY FROM STDIN, data is then written with copy_put and finished with proxy_copy_end
+ * return false if the server did not switch to COPY mode
+ */
+bool proxy_copy_begin(copy_buf_t *copy, PGconn *conn, const char *query) {
+    memset(copy, 0, sizeof(copy_buf_t));
+    copy->conn = conn;
+
+    if (!PQsendQuery(conn, query)) {
+        return false;
+    }
+
+    PGresult *res = proxy_get_last_result(conn);
+    bool ok = PQresultStatus(res) == PGRES_COPY_IN;
+    if (!ok) {
+        fprintf(stderr, "COPY failed: %s", PQresultErrorMessage(res));
+    }
+    PQclear(res);
+    return ok;
+}
+
+/* hands buffered data to libpq, the client waits for the socket while the output buffer of libpq is full */
+static void copy_flush(copy_buf_t *copy) {
+    while (!copy->failed && copy->len > 0) {
+        int ret = PQputCopyData(copy->conn, copy->data, (int) copy->len);
+        if (ret == 1) {
+            copy->len = 0;
+        } else if (ret < 0 || !proxy_flush(copy->conn)) {
+            copy->failed = true;
+        }
+    }
+}
+
+void copy_put(copy_buf_t *copy, const void *data, size_t len) {
+    if (copy->len + len > copy->capacity) {
+        copy->capacity = Max(copy->capacity * 2, Max(copy->len + len, COPY_CHUNK_SIZE));
+        copy->data = (char *) realloc(copy->data, copy->capacity);
+    }
+    memcpy(copy->data + copy->len, data, len);
+    copy->len += len;
+
+    if (copy->len >= COPY_CHUNK_SIZE) {
+        copy_flush(copy);
+    }
+}
+
+/* integers of binary COPY format are in network byte order */
+void copy_put_int16(copy_buf_t *copy, int16 value) {
+    uint16 n = htons((uint16) value);
+    copy_put(copy, &n, sizeof(n));
+}
+
+void copy_put_int32(copy_buf_t *copy, int32 value) {
+    uint32 n = htonl((uint32) value);
+    copy_put(copy, &n, sizeof(n));
+}
+
+void copy_put_int64(copy_buf_t *copy, int64 value) {
+    copy_put_int32(copy, (int32) ((uint64) value >> 32));
+    copy_put_int32(copy, (int32) value);
+}
+
+/* signature, flags and header extension length of binary COPY format */
+void copy_put_binary_header(copy_buf_t *copy) {
+    copy_put(copy, "PGCOPY\n\377\r\n\0", 11);
+    copy_put_int32(copy, 0);
+    copy_put_int32(copy, 0);
+}
+
+/**
+ * finishes COPY started by proxy_copy_begin, COPY is aborted if its data could not be sent
+ * return result of the whole COPY, its command tag counts the copied rows
+ */
+PGresult *proxy_copy_end(copy_buf_t *copy) {
+    copy_flush(copy);
+    while (PQputCopyEnd(copy->conn, copy->failed ? "sending COPY data failed" : NULL) == 0) {
+        if (!proxy_flush(copy->conn)) {
+            break;
+        }
+    }
+
+    free(copy->data);
+    copy->data = NULL;
+    copy->len = copy->capacity = 0;
+    return proxy_get_last_result(copy->conn);
+}
+
+static conn_pool_t *pools[POOL_MAX_DATABASES];
+static int pools_count = 0;
+/* connections to the maintenance database, used for database level commands */
+static conn_pool_t admin_pool = {.dbname = "postgres", .conninfo = PG_CONNINFO};
+/* borrowed for pg_proxy.database with SPI backend, NULL conn makes proxy_exec* use SPI */
+static pooled_conn_t spi_conn = {.conn = NULL, .pool = NULL, .in_use = true};
+
+/* opens connection in a free slot, the slot is returned in use */
+static bool pool_open_conn(conn_pool_t *pool, pooled_conn_t *slot) {
+    /* slot is reserved while the client waits for connection establishment */
+    slot->in_use = true;
+    pool->size++;
+
+    PGconn *conn = proxy_connect(pool->conninfo);
+    if (PQstatus(conn) != CONNECTION_OK || PQsetnonblocking(conn, 1) != 0 || !stmt_cache_attach(conn)) {
+        fprintf(stderr, "Connection to database %s failed: %s", pool->dbname, PQerrorMessage(conn));
+        PQfinish(conn);
+        slot->in_use = false;
+        pool->size--;
+        return false;
+    }
+
+    slot->conn = conn;
+    slot->pool = pool;
+    slot->created_at = ev_now(ev_default_loop(0));
+    slot->last_used_at = slot->created_at;
+    slot->checked_at = slot->created_at;
+    return true;
+}
+
+static void pool_close_conn(pooled_conn_t *pc) {
+    PQfinish(pc->conn);
+    pc->conn = NULL;
+    pc->in_use = false;
+    pc->pool->size--;
+}
+
+static bool pool_conn_is_healthy(pooled_conn_t *pc) {
+    if (PQstatus(pc->conn) != CONNECTION_OK) {
+        return false;
+    }
+
+    PGresult *res = proxy_exec(pc->conn, "SELECT 1");
+    bool healthy = PQresultStatus(res) == PGRES_TUPLES_OK;
+    PQclear(res);
+    pc->checked_at = ev_now(ev_default_loop(0));
+    return healthy;
+}
+
+/* open connections until pool has POOL_MIN_SIZE of them */
+static void pool_fill(conn_pool_t *pool) {
+    for (int i = 0; i < POOL_MAX_SIZE && pool->size < POOL_MIN_SIZE; i++) {
+        if (pool->conns[i].conn == NULL && !pool->conns[i].in_use) {
+            if (!pool_open_conn(pool, &pool->conns[i])) {
+                return;
+            }
+            pool->conns[i].in_use = false;
+        }
+    }
+}
+
+/**
+ * return idle connection of the pool (it is checked if it was idle for a long time)
+ * or a new one if pool has less than POOL_MAX_SIZE connections
+ * return NULL if pool is exhausted or connection failed
+ */
+static pooled_conn_t *pool_take(conn_pool_t *pool) {
+    ev_tstamp now = ev_now(ev_default_loop(0));
+    pooled_conn_t *free_slot = NULL;
+
+    for (int i = 0; i < POOL_MAX_SIZE; i++) {
+        pooled_conn_t *pc = &pool->conns[i];
+        if (pc->conn != NULL && !pc->in_use) {
+            /* taken before the health check, so other clients do not get it while we wait for the check */
+            pc->in_use = true;
+            if (now - pc->created_at > POOL_MAX_LIFETIME ||
+                (now - Max(pc->last_used_at, pc->checked_at) > POOL_HEALTH_CHECK_IDLE && !pool_conn_is_healthy(pc))) {
+                pool_close_conn(pc);
+            } else {
+                return pc;
+            }
+        }
+        if (pc->conn == NULL && !pc->in_use && free_slot == NULL) {
+            free_slot = pc;
+        }
+    }
+
+    if (free_slot == NULL || !pool_open_conn(pool, free_slot)) {
+        return NULL;
+    }
+    return free_slot;
+}
+
+/**
+ * return pool of dbname, creating it on first use
+ * database is checked (and created if it does not exist) only when its pool is created
+ */
+conn_pool_t *pool_get(const char *dbname) {
+    for (int i = 0; i < pools_count; i++) {
+        if (strcmp(pools[i]->dbname, dbname) == 0) {
+            return pools[i];
+        }
+    }
+
+    if (pools_count == POOL_MAX_DATABASES || strlen(dbname) >= NAMEDATALEN) {
+        fprintf(stderr, "Can not create connection pool of database %s\n", dbname);
+        return NULL;
+    }
+
+    pooled_conn_t *admin = pool_take(&admin_pool);
+    if (admin == NULL) {
+        return NULL;
+    }
+    bool exists = check_and_create_database(admin->conn, dbname);
+    pool_release(admin);
+    if (!exists) {
+        fprintf(stderr, "Failed to create or check database\n");
+        return NULL;
+    }
+
+    /* another client could create the pool while we were waiting for the check */
+    for (int i = 0; i < pools_count; i++) {
+        if (strcmp(pools[i]->dbname, dbname) == 0) {
+            return pools[i];
+        }
+    }
+
+    conn_pool_t *pool = (conn_pool_t *) calloc(1, sizeof(conn_pool_t));
+    snprintf(pool->dbname, sizeof(pool->dbname), "%s", dbname);
+    snprintf(pool->conninfo, sizeof(pool->conninfo), PG_CONNINFO_TEMPLATE, dbname);
+    pools[pools_count++] = pool;
+    return pool;
+}
+
+pooled_conn_t *pool_acquire(const char *dbname) {
+    /* a background worker is connected to one database only, others still use libpq */
+    if (proxy_backend == PROXY_BACKEND_SPI && strcmp(dbname, proxy_database) == 0) {
+        return &spi_conn;
+    }
+    return pool_acquire_libpq(dbname);
+}
+
+/* Returns pooled libpq connection to dbname even if pg_proxy.backend is spi, for commands that must not run in
+   the worker's own backend: SPI would block the event loop for as long as they take. */
+pooled_conn_t *pool_acquire_libpq(const char *dbname) {
+    conn_pool_t *pool = pool_get(dbname);
+    if (pool == NULL) {
+        return NULL;
+    }
+
+    /* while all connections are busy the client waits until one of them is released */
+    for (ev_tstamp waited = 0;; waited += POOL_WAIT_INTERVAL) {
+        pooled_conn_t *pc = pool_take(pool);
+        if (pc != NULL || pool->size < POOL_MAX_SIZE || current_client == NULL) {
+            return pc;
+        }
+        /* connections pinned by idle cursors are taken back before waiting for busy ones */
+        if (cursor_close_lru(dbname)) {
+            continue;
+        }
+        if (waited > POOL_ACQUIRE_TIMEOUT) {
+            fprintf(stderr, "Connection pool of database %s is exhausted\n", dbname);
+            return NULL;
+        }
+        client_sleep(POOL_WAIT_INTERVAL);
+    }
+}
+
+void pool_release(pooled_conn_t *pc) {
+    if (pc == &spi_conn) {
+        return;
+    }
+
+    /* connection that is broken or was left inside a transaction or pipeline is not reused */
+    if (PQstatus(pc->conn) != CONNECTION_OK || PQtransactionStatus(pc->conn) != PQTRANS_IDLE ||
+        PQpipelineStatus(pc->conn) != PQ_PIPELINE_OFF) {
+        pool_close_conn(pc);
+        return;
+    }
+
+    pc->in_use = false;
+    pc->last_used_at = ev_now(ev_default_loop(0));
+}
+
+/**
+ * closes idle connections that are too old, idle above POOL_MIN_SIZE for too long or broken,
+ * then refills pool up to POOL_MIN_SIZE
+ */
+static void pool_maintain(conn_pool_t *pool, ev_tstamp now) {
+    for (int i = 0; i < POOL_MAX_SIZE; i++) {
+        pooled_conn_t *pc = &pool->conns[i];
+        if (pc->conn == NULL || pc->in_use) {
+            continue;
+        }
+
+        if (now - pc->created_at > POOL_MAX_LIFETIME ||
+            (now - pc->last_used_at > POOL_IDLE_TIMEOUT && pool->size > POOL_MIN_SIZE)) {
+            pool_close_conn(pc);
+        } else if (now - pc->checked_at > POOL_HEALTH_CHECK_IDLE) {
+            /* taken for the check, the maintenance waits for the server while clients run */
+            pc->in_use = true;
+            if (!pool_conn_is_healthy(pc)) {
+                elog(LOG, "pg_proxy: dropping broken connection to database %s", pool->dbname);
+                pool_close_conn(pc);
+            } else {
+                pc->in_use = false;
+            }
+        }
+    }
+    pool_fill(pool);
+}
+
+void pool_maintenance(ev_tstamp now) {
+    cursor_reap(now);
+    pool_maintain(&admin_pool, now);
+    for (int i = 0; i < pools_count; i++) {
+        pool_maintain(pools[i], now);
+    }
+}
+
+/**
+ * opens POOL_MIN_SIZE connections to every existing database before the first client comes
+ */
+void pool_prewarm(void) {
+    pool_fill(&admin_pool);
+
+    pooled_conn_t *admin = pool_take(&admin_pool);
+    if (admin == NULL) {
+        return;
+    }
+
+    PGresult *res = proxy_exec(admin->conn,
+                               "SELECT datname FROM pg_database WHERE NOT datistemplate AND datallowconn "
+                               "AND datname <> 'postgres'");
+    if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+        fprintf(stderr, "Failed to list databases: %s", PQerrorMessage(admin->conn));
+        PQclear(res);
+        pool_release(admin);
+        return;
+    }
+
+    for (int i = 0; i < PQntuples(res) && pools_count < POOL_MAX_DATABASES; i++) {
+        if (proxy_backend == PROXY_BACKEND_SPI && strcmp(PQgetvalue(res, i, 0), proxy_database) == 0) {
+            continue;
+        }
+        conn_pool_t *pool = pool_get(PQgetvalue(res, i, 0));
+        if (pool != NULL) {
+            pool_fill(pool);
+        }
+    }
+    elog(LOG, "pg_proxy: connection pools of %d databases are warmed up", pools_count);
+
+    PQclear(res);
+    pool_release(admin);
+}
+
+/* Prewarming and maintenance of the pools run in a coroutine of their own, as connecting to the server and checking
+   its connections wait for it. A slow or hung server suspends the maintenance only, clients are served meanwhile. */
+static client_t *maintenance_client = NULL;
+
+static void pool_maintenance_entry_point(void *arg) {
+    pool_prewarm();
+    for (;;) {
+        client_sleep(POOL_MAINTENANCE_INTERVAL);
+        pool_maintenance(ev_now(ev_default_loop(0)));
+    }
+}
+
+static void pool_close_all(void) {
+    for (int i = 0; i < POOL_MAX_SIZE; i++) {
+        if (admin_pool.conns[i].conn != NULL) {
+            pool_close_conn(&admin_pool.conns[i]);
+        }
+    }
+    for (int i = 0; i < pools_count; i++) {
+        for (int j = 0; j < POOL_MAX_SIZE; j++) {
+            if (pools[i]->conns[j].conn != NULL) {
+                pool_close_conn(&pools[i]->conns[j]);
+            }
+        }
+        free(pools[i]);
+    }
+    pools_count = 0;
+}
+
+/* Check if database exists, and if not, create it.
+   Returns true if database exists or was created successfully, false otherwise. */
+bool check_and_create_database(PGconn *conn, const char *dbname) {
+    char query[BUFFER_SIZE];
+    PGresult *res;
+    const char *params[1] = {dbname};
+
+    res = proxy_exec_params(conn, "SELECT 1 FROM pg_database WHERE datname=$1", 1, params);
+    if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+        PQclear(res);
+        return false;
+    }
+
+    // ALTER USER user1 CREATEDB;
+    /* If database does not exist, create it. */
+    if (PQntuples(res) == 0) {
+        PQclear(res);
+        snprintf(query, sizeof(query), "CREATE DATABASE %s", dbname);
+        res = proxy_exec(conn, query);
+        if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+            PQclear(res);
+            return false;
+        }
+    }
+
+    PQclear(res);
+    return true;
+}
+
+/* Check if table exists, and if not, create it.
+   Returns true if table exists or was created successfully, false otherwise. */
+bool check_and_create_table(PGconn *conn, const char *table_name) {
+    char query[BUFFER_SIZE];
+    PGresult *res;
+
+    /* Tables created or checked recently cost no round trip. */
+    if (schema_table_known(conn, table_name)) {
+        return true;
+    }
+
+    /* Create table if it does not exist. */
+    snprintf(query, sizeof(query),
+             "CREATE TABLE IF NOT EXISTS %s ("
+             "_id SERIAL PRIMARY KEY, "
+             "data JSONB)",
+             table_name);
+
+    res = proxy_exec(conn, query);
+    if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+        fprintf(stderr, "Table creation failed: %s\n", PQerrorMessage(conn));
+        PQclear(res);
+        return false;
+    }
+
+    PQclear(res);
+    schema_table_add(conn, table_name);
+    return true;
+}
+
+/**
+ * finds the collection a command is run on and its database in the command document,
+ * both strings point into the document
+ * return false if either of them is missing
+ */
+static bool command_target(const mongo_msg_t *msg, const char *command, const char **collection,
+                           const char **dbname) {
+    bson_iter_t iter;
+
+    *collection = NULL;
+    *dbname = NULL;
+    if (msg->count == 0) {
+        return false;
+    }
+    if (bson_iter_init_find(&iter, msg->docs[0], command) && BSON_ITER_HOLDS_UTF8(&iter)) {
+        *collection = bson_iter_utf8(&iter, NULL);
+    }
+    if (bson_iter_init_find(&iter, msg->docs[0], "$db") && BSON_ITER_HOLDS_UTF8(&iter)) {
+        *dbname = bson_iter_utf8(&iter, NULL);
+    }
+    return *collection != NULL && *dbname != NULL;
+}
+
+/* points child to the embedded document at dotted path of doc, return false if there is no document there */
+static bool bson_find_document(const bson_t *doc, const char *path, bson_t *child) {
+    bson_iter_t iter, found;
+    uint32_t len;
+    const uint8_t *data;
+
+    if (!bson_iter_init(&iter, doc) || !bson_iter_find_descendant(&iter, path, &found) ||
+        !BSON_ITER_HOLDS_DOCUMENT(&found)) {
+        return false;
+    }
+    bson_iter_document(&found, &len, &data);
+    return bson_init_static(child, data, len);
+}
+
+/* Writes a single BSON value as JSON text, the same way libbson writes the documents stored in data.
+   Returns the text, freed with bson_free, or NULL if the value could not be written. */
+static char *bson_value_as_json(const bson_iter_t *iter) {
+    bson_t wrapper;
+    size_t len;
+
+    bson_init(&wrapper);
+    bson_append_iter(&wrapper, "v", 1, iter);
+    char *json = bson_as_relaxed_extended_json(&wrapper, &len);
+    bson_destroy(&wrapper);
+
+    /* The wrapper is written as { "v" : value } */
+    if (json == NULL || len < 10) {
+        bson_free(json);
+        return NULL;
+    }
+    memmove(json, json + 8, len - 10);
+    json[len - 10] = '\0';
+    return json;
+}
+
+/* Inserts documents into specified table with multi-row INSERT statements, every document is a parameter.
+   A batch with more documents than one statement takes is split into several statements run in one transaction.
+   Updates inserted count and returns true if all inserts were successful, false otherwise. */
+bool execute_insert_queries(PGconn *conn, const char *table_name, bson_t **docs, int n_docs, int *inserted_count) {
+    int n_stmts = (n_docs + INSERT_MAX_PARAMS - 1) / INSERT_MAX_PARAMS;
+    *inserted_count = 0;
+
+    proxy_stmt_t *stmts = (proxy_stmt_t *) calloc(n_stmts, sizeof(proxy_stmt_t));
+
+    for (int s = 0; s < n_stmts; s++) {
+        int first = s * INSERT_MAX_PARAMS;
+        int last = Min(first + INSERT_MAX_PARAMS, n_docs);
+        size_t query_size = 64 + strlen(table_name) + (last - first) * 18;
+        char *query = (char *) malloc(query_size);
+        size_t len;
+
+        /* Construct SQL query for insertion into jsonb column */
+        snprintf(query, query_size, "INSERT INTO %s (data) VALUES ", table_name);
+        len = strlen(query);
+
+        /* Placeholders are appended at the end of the query, so its length is never counted again */
+        for (int i = first; i < last; i++) {
+            char *json_str = bson_as_relaxed_extended_json(docs[i], NULL);
+
+            snprintf(query + len, query_size - len, "%s(", i == first ? "" : ",");
+            len += strlen(query + len);
+            query_add_param(&stmts[s].params, query + len, query_size - len, json_str);
+            len += strlen(query + len);
+            snprintf(query + len, query_size - len, "::jsonb)");
+            len += strlen(query + len);
+            bson_free(json_str);
+        }
+        stmts[s].query = query;
+    }
+
+    /* Shapes differ with the number of documents, so statements are not prepared */
+    bool ok = proxy_exec_pipeline(conn, stmts, n_stmts, false, true, inserted_count);
+    if (!ok) {
+        fprintf(stderr, "INSERT command failed\n");
+    }
+
+    for (int s = 0; s < n_stmts; s++) {
+        free(stmts[s].query);
+        query_params_free(&stmts[s].params);
+    }
+    free(stmts);
+    return ok;
+}
+
+/* Inserts documents with one binary COPY FROM STDIN, every document is written as jsonb value.
+   Updates inserted count and returns true if COPY was successful, false otherwise. */
+bool execute_insert_copy(PGconn *conn, const char *table_name, bson_t **docs, int n_docs, int *inserted_count) {
+    char query[BUFFER_SIZE];
+    copy_buf_t copy;
+    *inserted_count = 0;
+
+    snprintf(query, sizeof(query), "COPY %s (data) FROM STDIN WITH (FORMAT binary)", table_name);
+    if (!proxy_copy_begin(&copy, conn, query)) {
+        return false;
+    }
+
+    copy_put_binary_header(&copy);
+    for (int i = 0; i < n_docs; i++) {
+        size_t len = 0;
+        char *json_str = bson_as_relaxed_extended_json(docs[i], &len);
+
+        /* Binary jsonb is a version byte followed by JSON text */
+        copy_put_int16(&copy, 1);
+        if (json_str == NULL) {
+            copy_put_int32(&copy, -1);
+            continue;
+        }
+        copy_put_int32(&copy, (int32) len + 1);
+        copy_put(&copy, "\1", 1);
+        copy_put(&copy, json_str, len);
+        bson_free(json_str);
+    }
+    copy_put_int16(&copy, -1);
+
+    PGresult *res = proxy_copy_end(&copy);
+    bool ok = PQresultStatus(res) == PGRES_COMMAND_OK;
+    if (ok) {
+        *inserted_count = atoi(PQcmdTuples(res));
+    } else {
+        fprintf(stderr, "COPY command failed: %s", PQresultErrorMessage(res));
+    }
+    PQclear(res);
+    return ok;
+}
+
+/* Connects to database, creates it and required table if they don't exist,
+   and executes insert queries for given data array.
+   Returns true if operation was successful, false otherwise. */
+bool execute_query_insert_to_postgres(const mongo_msg_t *msg, int *inserted_count) {
+    const char *collection, *dbname;
+    if (!command_target(msg, "insert", &collection, &dbname)) {
+        fprintf(stderr, "Invalid insert command\n");
+        return false;
+    }
+
+    /* Borrow a connection to specified database, the pool creates the database if it does not exist */
+    pooled_conn_t *pc = pool_acquire(dbname);
+    if (pc == NULL) {
+        fprintf(stderr, "Failed to get connection to database %s\n", dbname);
+        return false;
+    }
+    PGconn *conn = pc->conn;
+
+    /* Check and create table if it does not exist */
+    if (!check_and_create_table(conn, collection)) {
+        fprintf(stderr, "Failed to create or check table\n");
+        pool_release(pc);
+        return false;
+    }
+
+    bson_t **docs = msg->docs + 1;
+    int n_docs = msg->count - 1;
+    if (n_docs <= 0) {
+        fprintf(stderr, "Insert has no documents\n");
+        pool_release(pc);
+        return false;
+    }
+
+    /* Large inserts are loaded with COPY, SPI backend has no COPY FROM STDIN and keeps statements */
+    bool ok;
+    if (conn != NULL && n_docs >= COPY_MIN_DOCUMENTS) {
+        ok = execute_insert_copy(conn, collection, docs, n_docs, inserted_count);
+        if (!ok) {
+            fprintf(stderr, "Failed to execute COPY\n");
+        }
+    } else {
+        ok = execute_insert_queries(conn, collection, docs, n_docs, inserted_count);
+        if (!ok) {
+            fprintf(stderr, "Failed to execute insert queries\n");
+        }
+    }
+    keyset_invalidate(dbname, collection);
+
+    pool_release(pc);
+    return ok;
+}
+
+/* Executes delete queries for each statement document from specified table.
+   Updates deleted count and returns true if all deletes were successful, false otherwise. */
+bool
+execute_delete_queries(PGconn *conn, const char *table_name, bson_t **deletes, int n_deletes, int *deleted_count) {
+    *deleted_count = 0;
+
+    /* Statements are built first and executed together, the ones before an invalid statement are still executed */
+    proxy_stmt_t *stmts = (proxy_stmt_t *) calloc(n_deletes, sizeof(proxy_stmt_t));
+    int n_queries = 0;
+    bool valid = true;
+
+    for (int i = 0; i < n_deletes; i++) {
+        bson_t q;
+        bson_iter_t limit_iter;
+
+        /* Validate delete statement */
+        if (!bson_find_document(deletes[i], "q", &q) || !bson_iter_init_find(&limit_iter, deletes[i], "limit")) {
+            fprintf(stderr, "Invalid delete statement\n");
+            valid = false;
+            break;
+        }
+
+        int limit = (int) bson_iter_as_int64(&limit_iter);
+
+        /* Filter becomes containment and jsonpath conditions, so indexes of the collection find the rows */
+        char condition[BUFFER_SIZE];
+        if (!build_jsonb_filter_condition(&q, condition, sizeof(condition), &stmts[n_queries].params)) {
+            fprintf(stderr, "Unsupported filter of delete statement\n");
+            valid = false;
+            break;
+        }
+
+        /* Construct full query string, only the filter shape and presence of the limit change the statement */
+        char query[BUFFER_SIZE * 2];
+        if (limit == 0) {
+            snprintf(query, sizeof(query), "DELETE FROM %s WHERE %s", table_name, condition);
+        } else {
+            char limit_str[16];
+            char limit_param[16] = "";
+            snprintf(limit_str, sizeof(limit_str), "%d", limit);
+            query_add_param(&stmts[n_queries].params, limit_param, sizeof(limit_param), limit_str);
+            snprintf(query, sizeof(query),
+                     "WITH del AS (SELECT ctid FROM %s WHERE %s LIMIT %s) "
+                     "DELETE FROM %s WHERE ctid IN (SELECT ctid FROM del)",
+                     table_name, condition, limit_param, table_name);
+        }
+        stmts[n_queries++].query = strdup(query);
+    }
+
+    /* Values are parameters, so statements of the same shape reuse one prepared statement */
+    bool ok = proxy_exec_pipeline(conn, stmts, n_queries, true, false, deleted_count);
+    if (!ok) {
+        fprintf(stderr, "DELETE command failed\n");
+    }
+
+    for (int i = 0; i < n_deletes; i++) {
+        free(stmts[i].query);
+        query_params_free(&stmts[i].params);
+    }
+    free(stmts);
+    return ok && valid;
+}
+
+/* Connects to database, checks and creates the required table if it doesn't exist,
+   and executes delete statements that follow the command in the message.
+   Returns true if operation was successful, false otherwise. */
+bool execute_query_delete_to_postgres(const mongo_msg_t *msg, int *deleted_count) {
+    const char *collection, *dbname;
+    if (!command_target(msg, "delete", &collection, &dbname)) {
+        fprintf(stderr, "Invalid delete command\n");
+        return false;
+    }
+
+    /* Borrow a connection to specified database, the pool creates the database if it does not exist */
+    pooled_conn_t *pc = pool_acquire(dbname);
+    if (pc == NULL) {
+        fprintf(stderr, "Failed to get connection to database %s\n", dbname);
+        return false;
+    }
+    PGconn *conn = pc->conn;
+
+    /* Check and create table if it does not exist */
+    if (!check_and_create_table(conn, collection)) {
+        fprintf(stderr, "Failed to create or check table\n");
+        pool_release(pc);
+        return false;
+    }
+
+    /* Statements are the documents after the command, parse_message moves them there from the body */
+    if (msg->count <= 1) {
+        fprintf(stderr, "Delete has no statements\n");
+        pool_release(pc);
+        return false;
+    }
+
+    /* Execute delete queries, a failed batch may have written some of its statements */
+    bool ok = execute_delete_queries(conn, collection, msg->docs + 1, msg->count - 1, deleted_count);
+    if (!ok) {
+        fprintf(stderr, "Failed to execute delete queries\n");
+    }
+    keyset_invalidate(dbname, collection);
+
+    pool_release(pc);
+    return ok;
+}
+
+/* appends str to the statement in quote characters, quotes inside it are doubled as SQL expects */
+static void sql_append_quoted(char *buf, size_t size, const char *str, char quote) {
+    size_t len = strlen(buf);
+
+    if (len + 1 < size) {
+        buf[len++] = quote;
+    }
+    for (; *str != '\0' && len + 3 < size; str++) {
+        if (*str == quote) {
+            buf[len++] = quote;
+        }
+        buf[len++] = *str;
+    }
+    if (len + 1 < size) {
+        buf[len++] = quote;
+    }
+    buf[len] = '\0';
+}
+
+/* appends value at dotted path to doc, {"a.b": 1} becomes {"a": {"b": 1}} */
+static void bson_append_path(bson_t *doc, const char *path, const bson_iter_t *value) {
+    const char *dot = strchr(path, '.');
+    bson_t child;
+
+    if (dot == NULL) {
+        bson_append_iter(doc, path, -1, value);
+        return;
+    }
+    bson_append_document_begin(doc, path, (int) (dot - path), &child);
+    bson_append_path(&child, dot + 1, value);
+    bson_append_document_end(doc, &child);
+}
+
+/* return true if the value has the same literal in jsonpath as in JSON: strings, finite numbers, booleans and null */
+static bool jsonpath_literal_supported(const bson_iter_t *iter) {
+    switch (bson_iter_type(iter)) {
+        case BSON_TYPE_UTF8:
+        case BSON_TYPE_INT32:
+        case BSON_TYPE_INT64:
+        case BSON_TYPE_BOOL:
+        case BSON_TYPE_NULL:
+            return true;
+        case BSON_TYPE_DOUBLE:
+            return isfinite(bson_iter_double(iter));
+        default:
+            return false;
+    }
+}
+
+/* appends exact jsonpath of dotted field, "a.b" becomes $."a"."b" */
+static void jsonpath_append_field(char *jsonpath, size_t size, const char *key) {
+    const char *part = key;
+    const char *dot;
+
+    strncat(jsonpath, "$", size - strlen(jsonpath) - 1);
+    do {
+        dot = strchr(part, '.');
+        size_t len = dot != NULL ? (size_t) (dot - part) : strlen(part);
+        char name[BUFFER_SIZE];
+        snprintf(name, sizeof(name), "%.*s", (int) len, part);
+        strncat(jsonpath, ".", size - strlen(jsonpath) - 1);
+        sql_append_quoted(jsonpath, size, name, '"');
+        part = dot + 1;
+    } while (dot != NULL);
+}
+
+/* Writes jsonb expression of dotted path, "b.c" becomes (data->'b'->'c').
+   Sort keys and range conditions of find and btree indexes of createIndexes are built by it alike,
+   so the planner matches them. */
+static void jsonb_path_expression(char *buf, size_t size, const char *path) {
+    const char *dot;
+
+    snprintf(buf, size, "(data");
+    while (1) {
+        char part[NAMEDATALEN * 4];
+        dot = strchr(path, '.');
+        snprintf(part, sizeof(part), "%.*s", (int) (dot != NULL ? (size_t) (dot - path) : strlen(path)), path);
+        strncat(buf, "->", size - strlen(buf) - 1);
+        sql_append_quoted(buf, size, part, '\'');
+        if (dot == NULL) {
+            break;
+        }
+        path = dot + 1;
+    }
+    strncat(buf, ")", size - strlen(buf) - 1);
+}
+
+/* Appends element to PostgreSQL array literal of len characters, array is NULL before the first element.
+   Elements are double quoted, so any text is kept as it is. The literal is closed by pg_array_end. */
+static char *pg_array_add(char *array, size_t *len, const char *element) {
+    array = (char *) realloc(array, *len + 2 * strlen(element) + 5);
+    char *p = array + *len;
+
+    *p++ = *len == 0 ? '{' : ',';
+    *p++ = '"';
+    for (; *element != '\0'; element++) {
+        if (*element == '"' || *element == '\\') {
+            *p++ = '\\';
+        }
+        *p++ = *element;
+    }
+    *p++ = '"';
+    *p = '\0';
+    *len = p - array;
+    return array;
+}
+
+/* closes array literal built by pg_array_add, an array without elements is {} */
+static char *pg_array_end(char *array, size_t len) {
+    array = (char *) realloc(array, len + 3);
+    strcpy(array + len, len == 0 ? "{}" : "}");
+    return array;
+}
+
+/* return true if value is an operator document like {$gt: 1} rather than a document to compare with */
+static bool bson_is_operator_document(const bson_iter_t *value) {
+    bson_iter_t child;
+
+    return BSON_ITER_HOLDS_DOCUMENT(value) && bson_iter_recurse(value, &child) && bson_iter_next(&child) &&
+           bson_iter_key(&child)[0] == '$';
+}
+
+/* return true if value is neither a document nor an array */
+static bool bson_is_scalar(const bson_iter_t *value) {
+    return !BSON_ITER_HOLDS_DOCUMENT(value) && !BSON_ITER_HOLDS_ARRAY(value);
+}
+
+/* Adds containment documents of value at dotted field to array literal built by pg_array_add, {"a": value}
+   and {"a": [value]}. Containment lets an array contain a scalar only at the top level of the contained
+   document, so the second one is what matches value as an element of an array field. */
+static char *jsonb_array_add_contained(char *array, size_t *len, const char *key, const bson_iter_t *value) {
+    bson_t nested, wrapper, element;
+    bson_iter_t wrapped;
+
+    bson_init(&nested);
+    bson_append_path(&nested, key, value);
+    char *json = bson_as_relaxed_extended_json(&nested, NULL);
+    array = pg_array_add(array, len, json);
+    bson_free(json);
+    bson_destroy(&nested);
+
+    bson_init(&wrapper);
+    bson_append_array_begin(&wrapper, "v", 1, &element);
+    bson_append_iter(&element, "0", 1, value);
+    bson_append_array_end(&wrapper, &element);
+    bson_init(&nested);
+    if (bson_iter_init_find(&wrapped, &wrapper, "v")) {
+        bson_append_path(&nested, key, &wrapped);
+    }
+    json = bson_as_relaxed_extended_json(&nested, NULL);
+    array = pg_array_add(array, len, json);
+    bson_free(json);
+    bson_destroy(&nested);
+    bson_destroy(&wrapper);
+    return array;
+}
+
+/* Appends containment of value at dotted field. A scalar is matched as data @> ANY($n::jsonb[]) of
+   {"a": value} and {"a": [value]}, so it is found inside an array field as well, see jsonb_array_add_contained.
+   Documents and arrays are matched as data @> {"a": value}. */
+static void jsonb_append_containment(const char *key, const bson_iter_t *value, char *condition, size_t size,
+                                     query_params_t *params) {
+    bson_t nested;
+
+    if (bson_is_scalar(value)) {
+        size_t len = 0;
+        char *array = pg_array_end(jsonb_array_add_contained(NULL, &len, key, value), len);
+
+        strncat(condition, "data @> ANY(", size - strlen(condition) - 1);
+        query_add_param(params, condition, size, array);
+        strncat(condition, "::jsonb[])", size - strlen(condition) - 1);
+        free(array);
+        return;
+    }
+
+    bson_init(&nested);
+    bson_append_path(&nested, key, value);
+    char *nested_json = bson_as_relaxed_extended_json(&nested, NULL);
+    strncat(condition, "data @> ", size - strlen(condition) - 1);
+    query_add_param(params, condition, size, nested_json);
+    strncat(condition, "::jsonb", size - strlen(condition) - 1);
+    bson_free(nested_json);
+    bson_destroy(&nested);
+}
+
+/* Appends jsonpath filter comparing value at field, $."a"."b" ? (@ > value), checked with @?.
+   Path, operator and value are one parameter, so the statement only depends on the number of comparisons.
+   Lax jsonpath looks into arrays and compares values of the same type only, as find does. */
+static void jsonb_append_comparison(const char *key, const char *op, const bson_iter_t *value, char *condition,
+                                    size_t size, query_params_t *params) {
+    char jsonpath[BUFFER_SIZE] = "";
+    char *value_json = bson_value_as_json(value);
+
+    jsonpath_append_field(jsonpath, sizeof(jsonpath), key);
+    snprintf(jsonpath + strlen(jsonpath), sizeof(jsonpath) - strlen(jsonpath), " ? (@ %s %s)", op,
+             value_json != NULL ? value_json : "null");
+    bson_free(value_json);
+
+    strncat(condition, "data @? ", size - strlen(condition) - 1);
+    query_add_param(params, condition, size, jsonpath);
+    strncat(condition, "::jsonpath", size - strlen(condition) - 1);
+}
+
+/* returns what jsonb_typeof gives for values of the type of value, NULL for values without a jsonpath literal */
+static const char *jsonb_value_type(const bson_iter_t *value) {
+    switch (bson_iter_type(value)) {
+        case BSON_TYPE_UTF8:
+            return "string";
+        case BSON_TYPE_INT32:
+        case BSON_TYPE_INT64:
+        case BSON_TYPE_DOUBLE:
+            return jsonpath_literal_supported(value) ? "number" : NULL;
+        case BSON_TYPE_BOOL:
+            return "boolean";
+        case BSON_TYPE_NULL:
+            return "null";
+        default:
+            return NULL;
+    }
+}
+
+/* return true if a part of dotted path is a number, an array position that data->'a'->'0' does not follow */
+static bool jsonb_path_has_position(const char *key) {
+    const char *part = key;
+
+    do {
+        size_t digits = strspn(part, "0123456789");
+        if (digits > 0 && (part[digits] == '.' || part[digits] == '\0')) {
+            return true;
+        }
+        part = strchr(part, '.');
+    } while (part++ != NULL);
+    return false;
+}
+
+/* Appends range comparison of field and value, (data->'a') > $n::jsonb AND jsonb_typeof(data->'a') = 'number'.
+   jsonb orders values of one type as find compares them and the type check leaves out values of other types,
+   as find does. The expression is the one btree indexes of createIndexes are built on, so the planner serves
+   the range by an index scan, and the type is a literal, so a pgType index partial to that type serves it too.
+   Unlike the jsonpath of jsonb_append_comparison, elements of an array field are not compared. */
+static void jsonb_append_range(const char *key, const char *op, const bson_iter_t *value, char *condition,
+                               size_t size, query_params_t *params) {
+    char expr[BUFFER_SIZE];
+    char *value_json = bson_value_as_json(value);
+
+    jsonb_path_expression(expr, sizeof(expr), key);
+    snprintf(condition + strlen(condition), size - strlen(condition), "%s %s ", expr, op);
+    query_add_param(params, condition, size, value_json != NULL ? value_json : "null");
+    snprintf(condition + strlen(condition), size - strlen(condition), "::jsonb AND jsonb_typeof%s = ", expr);
+    sql_append_quoted(condition, size, jsonb_value_type(value), '\'');
+    bson_free(value_json);
+}
+
+/* appends equality of field and value, dotted fields with jsonpath literals by exact jsonpath, others by containment */
+static void jsonb_append_equality(const char *key, const bson_iter_t *value, char *condition, size_t size,
+                                  query_params_t *params) {
+    if (strchr(key, '.') != NULL && jsonpath_literal_supported(value)) {
+        jsonb_append_comparison(key, "==", value, condition, size, params);
+    } else {
+        jsonb_append_containment(key, value, condition, size, params);
+    }
+}
+
+/* Appends match of field against any of values as data @> ANY($n::jsonb[]), GIN index serves it by a bitmap scan
+   with one search per element. Every value is contained both as it is and as an element of an array.
+   Returns false if values are not an array. */
+static bool jsonb_append_in(const char *key, const bson_iter_t *values, char *condition, size_t size,
+                            query_params_t *params) {
+    bson_iter_t child;
+    char *array = NULL;
+    size_t len = 0;
+
+    if (!BSON_ITER_HOLDS_ARRAY(values) || !bson_iter_recurse(values, &child)) {
+        return false;
+    }
+    while (bson_iter_next(&child)) {
+        array = jsonb_array_add_contained(array, &len, key, &child);
+    }
+    array = pg_array_end(array, len);
+
+    strncat(condition, "data @> ANY(", size - strlen(condition) - 1);
+    query_add_param(params, condition, size, array);
+    strncat(condition, "::jsonb[])", size - strlen(condition) - 1);
+    free(array);
+    return true;
+}
+
+/* appends presence of field, data ? 'a' for top level fields and jsonpath of dotted ones */
+static void jsonb_append_exists(const char *key, char *condition, size_t size, query_params_t *params) {
+    if (strchr(key, '.') == NULL) {
+        strncat(condition, "data ? ", size - strlen(condition) - 1);
+        query_add_param(params, condition, size, key);
+        return;
+    }
+
+    char jsonpath[BUFFER_SIZE] = "";
+    jsonpath_append_field(jsonpath, sizeof(jsonpath), key);
+    strncat(condition, "data @? ", size - strlen(condition) - 1);
+    query_add_param(params, condition, size, jsonpath);
+    strncat(condition, "::jsonpath", size - strlen(condition) - 1);
+}
+
+/* returns comparison operator of range query operator, the same in SQL and jsonpath, NULL for others */
+static const char *jsonpath_range_operator(const char *op) {
+    if (strcmp(op, "$gt") == 0) {
+        return ">";
+    }
+    if (strcmp(op, "$gte") == 0) {
+        return ">=";
+    }
+    if (strcmp(op, "$lt") == 0) {
+        return "<";
+    }
+    if (strcmp(op, "$lte") == 0) {
+        return "<=";
+    }
+    return NULL;
+}
+
+/* Appends conditions of operator document on field, {$gte: 1, $lt: 5} becomes two comparisons joined by AND.
+   Returns false on unknown operators and on values the operator does not take. */
+static bool jsonb_append_operators(const char *key, const bson_iter_t *ops, char *condition, size_t size,
+                                   query_params_t *params) {
+    bson_iter_t op;
+    bool first = true;
+
+    if (!bson_iter_recurse(ops, &op)) {
+        return false;
+    }
+    while (bson_iter_next(&op)) {
+        const char *name = bson_iter_key(&op);
+        const char *range = jsonpath_range_operator(name);
+
+        if (!first) {
+            strncat(condition, " AND ", size - strlen(condition) - 1);
+        }
+        first = false;
+
+        if (strcmp(name, "$eq") == 0) {
+            jsonb_append_equality(key, &op, condition, size, params);
+        } else if (strcmp(name, "$ne") == 0) {
+            /* Documents without the field match as well, as find does */
+            strncat(condition, "NOT (", size - strlen(condition) - 1);
+            jsonb_append_equality(key, &op, condition, size, params);
+            strncat(condition, ")", size - strlen(condition) - 1);
+        } else if (range != NULL) {
+            if (!jsonpath_literal_supported(&op)) {
+                fprintf(stderr, "Unsupported value of %s on %s\n", name, key);
+                return false;
+            }
+            if (jsonb_path_has_position(key)) {
+                jsonb_append_comparison(key, range, &op, condition, size, params);
+            } else {
+                jsonb_append_range(key, range, &op, condition, size, params);
+            }
+        } else if (strcmp(name, "$in") == 0 || strcmp(name, "$nin") == 0) {
+            bool negate = strcmp(name, "$nin") == 0;
+            if (negate) {
+                strncat(condition, "NOT (", size - strlen(condition) - 1);
+            }
+            if (!jsonb_append_in(key, &op, condition, size, params)) {
+                fprintf(stderr, "%s on %s needs an array\n", name, key);
+                return false;
+            }
+            if (negate) {
+                strncat(condition, ")", size - strlen(condition) - 1);
+            }
+        } else if (strcmp(name, "$exists") == 0) {
+            if (!bson_iter_as_bool(&op)) {
+                strncat(condition, "NOT ", size - strlen(condition) - 1);
+            }
+            jsonb_append_exists(key, condition, size, params);
+        } else {
+            fprintf(stderr, "Unsupported query operator %s\n", name);
+            return false;
+        }
+    }
+    return !first;
+}
+
+static bool jsonb_filter_append(const bson_t *q, char *condition, size_t size, query_params_t *params);
+
+/* Appends $and, $or or $nor of filter documents, every one of them in parentheses.
+   An $or of indexed fields is planned as BitmapOr of their index scans. Returns false if the list is not valid. */
+static bool jsonb_append_logical(const char *name, const bson_iter_t *value, char *condition, size_t size,
+                                 query_params_t *params) {
+    const char *join = strcmp(name, "$and") == 0 ? " AND " : " OR ";
+    bson_iter_t child;
+    bool first = true;
+
+    if (!BSON_ITER_HOLDS_ARRAY(value) || !bson_iter_recurse(value, &child)) {
+        return false;
+    }
+    strncat(condition, strcmp(name, "$nor") == 0 ? "NOT (" : "(", size - strlen(condition) - 1);
+    while (bson_iter_next(&child)) {
+        bson_t branch;
+        const uint8_t *data;
+        uint32_t len;
+
+        if (!BSON_ITER_HOLDS_DOCUMENT(&child)) {
+            return false;
+        }
+        bson_iter_document(&child, &len, &data);
+        if (!bson_init_static(&branch, data, len)) {
+            return false;
+        }
+
+        if (!first) {
+            strncat(condition, join, size - strlen(condition) - 1);
+        }
+        first = false;
+        strncat(condition, "(", size - strlen(condition) - 1);
+        if (!jsonb_filter_append(&branch, condition, size, params)) {
+            return false;
+        }
+        strncat(condition, ")", size - strlen(condition) - 1);
+    }
+    strncat(condition, ")", size - strlen(condition) - 1);
+    return !first;
+}
+
+/* Appends condition of filter document q, its fields are joined by AND and an empty filter is TRUE.
+   Plain top level documents and arrays are matched together by containment, data @> {...}, which GIN
+   jsonb_path_ops serves. A plain top level scalar gets data @> ANY(...) of its own, which GIN serves as well and
+   which also finds the value inside an array field as find does, see jsonb_append_containment.
+   Dotted fields become exact jsonpaths checked with @?, $."a"."b" ? (@ == value), so GIN serves them too
+   and only the named path is looked at. Values without a jsonpath literal are matched by containment instead.
+   Operator documents and $and, $or, $nor are translated by the functions above.
+   Returns false if the filter has an operator that is not supported. */
+static bool jsonb_filter_append(const bson_t *q, char *condition, size_t size, query_params_t *params) {
+    bson_iter_t iter;
+    bson_t contained;
+    bool has_contained = false;
+    size_t start = strlen(condition);
+
+    bson_init(&contained);
+
+    if (bson_iter_init(&iter, q)) {
+        while (bson_iter_next(&iter)) {
+            const char *key = bson_iter_key(&iter);
+
+            if (key[0] == '$') {
+                if (strcmp(key, "$and") != 0 && strcmp(key, "$or") != 0 && strcmp(key, "$nor") != 0) {
+                    fprintf(stderr, "Unsupported query operator %s\n", key);
+                    bson_destroy(&contained);
+                    return false;
+                }
+                if (!jsonb_append_logical(key, &iter, condition, size, params)) {
+                    fprintf(stderr, "%s needs a nonempty array of filters\n", key);
+                    bson_destroy(&contained);
+                    return false;
+                }
+                strncat(condition, " AND ", size - strlen(condition) - 1);
+            } else if (bson_is_operator_document(&iter)) {
+                if (!jsonb_append_operators(key, &iter, condition, size, params)) {
+                    bson_destroy(&contained);
+                    return false;
+                }
+                strncat(condition, " AND ", size - strlen(condition) - 1);
+            } else if (strchr(key, '.') == NULL && !bson_is_scalar(&iter)) {
+                bson_append_iter(&contained, key, -1, &iter);
+                has_contained = true;
+            } else {
+                /* Scalars and nested documents of a field do not merge with others, they get a check of their own */
+                jsonb_append_equality(key, &iter, condition, size, params);
+                strncat(condition, " AND ", size - strlen(condition) - 1);
+            }
+        }
+    }
+
+    if (has_contained) {
+        char *contained_json = bson_as_relaxed_extended_json(&contained, NULL);
+        strncat(condition, "data @> ", size - strlen(condition) - 1);
+        query_add_param(params, condition, size, contained_json);
+        strncat(condition, "::jsonb AND ", size - strlen(condition) - 1);
+        bson_free(contained_json);
+    }
+    bson_destroy(&contained);
+
+    /* An empty filter matches every document */
+    if (strlen(condition) == start) {
+        strncat(condition, "TRUE", size - strlen(condition) - 1);
+        return true;
+    }
+
+    /* Remove trailing " AND " */
+    condition[strlen(condition) - 5] = '\0';
+    return true;
+}
+
+/* Builds SQL condition over the data column from given filter document, values are passed in params.
+   Returns false if the filter has an operator that is not supported. */
+bool build_jsonb_filter_condition(const bson_t *q, char *condition, size_t size, query_params_t *params) {
+    condition[0] = '\0';
+    return jsonb_filter_append(q, condition, size, params);
+}
+
+/* Builds JSON path from given key.
+   Appends path to provided path variable. */
+void build_jsonb_path(const char *key, char *path) {
+    const char *delimiter = ".";
+    char *key_copy = strdup(key);
+    char *token = strtok(key_copy, delimiter);
+
+    while (token != NULL) {
+        strcat(path, "\"");
+        strcat(path, token);
+        strcat(path, "\", ");
+        token = strtok(NULL, delimiter);
+    }
+
+    /* Remove trailing comma and space */
+    path[strlen(path) - 2] = '\0';
+
+    free(key_copy);
+}
+
+/* Executes update queries for each statement document from specified table.
+   Updates updated count and returns true if all updates were successful, false otherwise. */
+bool
+execute_update_queries(PGconn *conn, const char *table_name, bson_t **updates, int n_updates, int *updated_count) {
+    *updated_count = 0;
+
+    /* Statements are built first and executed together, the ones before an invalid statement are still executed */
+    proxy_stmt_t *stmts = (proxy_stmt_t *) calloc(n_updates, sizeof(proxy_stmt_t));
+    int n_queries = 0;
+    bool valid = true;
+
+    for (int i = 0; i < n_updates; i++) {
+        bson_t q, u, set;
+        bson_iter_t field, multi_iter;
+
+        /* Validate update statement */
+        if (!bson_find_document(updates[i], "q", &q) || !bson_find_document(updates[i], "u", &u)) {
+            fprintf(stderr, "Invalid update statement at index %d\n", i);
+            valid = false;
+            break;
+        }
+
+        /* Validate $set document */
+        if (!bson_find_document(&u, "$set", &set) || !bson_iter_init(&field, &set)) {
+            fprintf(stderr, "Invalid $set document at index %d\n", i);
+            valid = false;
+            break;
+        }
+
+        /* Initialize jsonb_set_clause */
+        char jsonb_set_clause[BUFFER_SIZE * 10] = "";
+
+        while (bson_iter_next(&field)) {
+            char field_path[BUFFER_SIZE] = "";
+            build_jsonb_path(bson_iter_key(&field), field_path);
+
+            char *value_json = bson_value_as_json(&field);
+            char value_param[16] = "";
+            query_add_param(&stmts[n_queries].params, value_param, sizeof(value_param), value_json);
+            bson_free(value_json);
+
+            char single_set_clause[BUFFER_SIZE];
+            snprintf(single_set_clause, sizeof(single_set_clause),
+                     "jsonb_set(data, '{%s}', %s::jsonb, true)", field_path, value_param);
+
+            strcat(jsonb_set_clause, single_set_clause);
+            strcat(jsonb_set_clause, ", ");
+        }
+
+        /* Remove last ", " */
+        if (strlen(jsonb_set_clause) > 0) {
+            jsonb_set_clause[strlen(jsonb_set_clause) - 2] = '\0';
+        }
+
+        /* Build condition of the filter, values are parameters after the ones of $set */
+        char condition[BUFFER_SIZE];
+        if (!build_jsonb_filter_condition(&q, condition, sizeof(condition), &stmts[n_queries].params)) {
+            fprintf(stderr, "Unsupported filter of update statement\n");
+            valid = false;
+            break;
+        }
+
+        char query[BUFFER_SIZE * 20];
+        if (bson_iter_init_find(&multi_iter, updates[i], "multi") && bson_iter_as_bool(&multi_iter)) {
+            snprintf(query, sizeof(query),
+                     "UPDATE %s SET data = %s WHERE %s",
+                     table_name, jsonb_set_clause, condition);
+        } else {
+            snprintf(query, sizeof(query),
+                     "UPDATE %s SET data = %s WHERE ctid IN (SELECT ctid FROM %s WHERE %s LIMIT 1)",
+                     table_name, jsonb_set_clause, table_name, condition);
+        }
+        stmts[n_queries++].query = strdup(query);
+    }
+
+    /* Values are parameters, so statements of the same shape reuse one prepared statement */
+    bool ok = proxy_exec_pipeline(conn, stmts, n_queries, true, false, updated_count);
+    if (!ok) {
+        fprintf(stderr, "UPDATE command failed\n");
+    }
+
+    for (int i = 0; i < n_updates; i++) {
+        free(stmts[i].query);
+        query_params_free(&stmts[i].params);
+    }
+    free(stmts);
+    return ok && valid;
+}
+
+/* Connects to database, checks and creates required table if it doesn't exist,
+   and executes update statements that follow the command in the message.
+   Returns true if operation was successful, false otherwise. */
+bool execute_query_update_to_postgres(const mongo_msg_t *msg, int *updated_count) {
+    const char *collection, *dbname;
+    if (!command_target(msg, "update", &collection, &dbname)) {
+        fprintf(stderr, "Invalid update command\n");
+        return false;
+    }
+
+    /* Borrow a connection to specified database, the pool creates the database if it does not exist */
+    pooled_conn_t *pc = pool_acquire(dbname);
+    if (pc == NULL) {
+        fprintf(stderr, "Failed to get connection to database %s\n", dbname);
+        return false;
+    }
+    PGconn *conn = pc->conn;
+
+    /* Check and create table if it does not exist */
+    if (!check_and_create_table(conn, collection)) {
+        fprintf(stderr, "Failed to create or check table\n");
+        pool_release(pc);
+        return false;
+    }
+
+    /* Statements are the documents after the command, parse_message moves them there from the body */
+    if (msg->count <= 1) {
+        fprintf(stderr, "Update has no statements\n");
+        pool_release(pc);
+        return false;
+    }
+
+    /* Execute update queries, a failed batch may have written some of its statements */
+    bool ok = execute_update_queries(conn, collection, msg->docs + 1, msg->count - 1, updated_count);
+    if (!ok) {
+        fprintf(stderr, "Failed to execute update queries\n");
+    }
+    keyset_invalidate(dbname, collection);
+
+    pool_release(pc);
+    return ok;
+}
+
+static proxy_cursor_t *cursors[CURSOR_MAX_OPEN];
+static uint64 cursor_portal_seq;
+
+static proxy_cursor_t *cursor_find(int64 id) {
+    for (int i = 0; i < CURSOR_MAX_OPEN; i++) {
+        if (cursors[i] != NULL && cursors[i]->id == id) {
+            return cursors[i];
+        }
+    }
+    return NULL;
+}
+
+static void cursor_close(proxy_cursor_t *cursor);
+
+/* Closes the cursor of dbname, of any database if it is NULL, that is not busy and was used longest ago.
+   Its connection goes back to the pool. Returns false if there is no such cursor. */
+bool cursor_close_lru(const char *dbname) {
+    proxy_cursor_t *victim = NULL;
+
+    for (int i = 0; i < CURSOR_MAX_OPEN; i++) {
+        proxy_cursor_t *cursor = cursors[i];
+        if (cursor != NULL && !cursor->busy && (dbname == NULL || strcmp(cursor->dbname, dbname) == 0) &&
+            (victim == NULL || cursor->last_used_at < victim->last_used_at)) {
+            victim = cursor;
+        }
+    }
+    if (victim == NULL) {
+        return false;
+    }
+    elog(LOG, "pg_proxy: closing cursor %lld on %s.%s unused for the longest time", (long long int) victim->id,
+         victim->dbname, victim->collection);
+    /* busy while the commit waits for the server, so getMore and killCursors leave it alone */
+    victim->busy = true;
+    cursor_close(victim);
+    return true;
+}
+
+/**
+ * registers new cursor on the connection, the cursor is busy until its first batch is read.
+ * its id is random below CURSOR_WORKER_SHIFT and the index of this worker above, see execute_query_getmore.
+ * with SPI backend the cursor takes a libpq connection of the pool instead of pc: every SPI command commits,
+ * and a portal declared WITH HOLD to outlive it would have its whole result read at that commit.
+ * when the worker has CURSOR_MAX_OPEN cursors open already, or the database CURSOR_MAX_PER_DATABASE,
+ * the one unused for the longest time is closed
+ * return NULL if every cursor that would make room is busy or no connection is left for the cursor
+ */
+static proxy_cursor_t *cursor_create(pooled_conn_t *pc, const char *dbname, const char *collection) {
+    bool own_conn = pc->conn == NULL;
+    if (own_conn && (pc = pool_acquire_libpq(dbname)) == NULL) {
+        return NULL;
+    }
+    for (;;) {
+        int slot = -1;
+        int n_database = 0;
+        for (int i = 0; i < CURSOR_MAX_OPEN; i++) {
+            if (cursors[i] == NULL) {
+                slot = slot < 0 ? i : slot;
+            } else if (strcmp(cursors[i]->dbname, dbname) == 0) {
+                n_database++;
+            }
+        }
+
+        if (slot >= 0 && n_database < CURSOR_MAX_PER_DATABASE) {
+            proxy_cursor_t *cursor = (proxy_cursor_t *) calloc(1, sizeof(proxy_cursor_t));
+            do {
+                cursor->id = ((int64) worker_index << CURSOR_WORKER_SHIFT) |
+                             ((((int64) random() << 32) ^ random()) & (((int64) 1 << CURSOR_WORKER_SHIFT) - 1));
+            } while (cursor->id == 0 || cursor_find(cursor->id) != NULL);
+            cursor->pc = pc;
+            snprintf(cursor->name, sizeof(cursor->name), "pg_proxy_cursor_%llu",
+                     (unsigned long long) ++cursor_portal_seq);
+            snprintf(cursor->dbname, sizeof(cursor->dbname), "%s", dbname);
+            snprintf(cursor->collection, sizeof(cursor->collection), "%s", collection);
+            cursor->busy = true;
+            cursors[slot] = cursor;
+            return cursor;
+        }
+
+        /* the slots are looked at again after the commit of the closed cursor */
+        if (!cursor_close_lru(slot >= 0 ? dbname : NULL)) {
+            if (own_conn) {
+                pool_release(pc);
+            }
+            return NULL;
+        }
+    }
+}
+
+/* closes the portal of the cursor and gives its connection back to the pool */
+static void cursor_close(proxy_cursor_t *cursor) {
+    PGconn *conn = cursor->pc->conn;
+
+    /* the portal is closed together with the transaction it was declared in */
+    if (PQstatus(conn) == CONNECTION_OK && PQpipelineStatus(conn) == PQ_PIPELINE_OFF) {
+        PQclear(proxy_exec(conn, "COMMIT"));
+    }
+    pool_release(cursor->pc);
+
+    for (int i = 0; i < CURSOR_MAX_OPEN; i++) {
+        if (cursors[i] == cursor) {
+            cursors[i] = NULL;
+        }
+    }
+    PQclear(cursor->pending);
+    free(cursor);
+}
+
+/**
+ * declares portal of the query in a new transaction of the pinned connection and fetches first count rows.
+ * BEGIN, DECLARE and FETCH go in one pipeline, so opening a cursor costs a single round trip.
+ * the connection is always a libpq one, see cursor_create
+ */
+static PGresult *cursor_open(proxy_cursor_t *cursor, const char *query, const query_params_t *params, int count) {
+    PGconn *conn = cursor->pc->conn;
+    size_t declare_size = strlen(query) + 96;
+    char *declare = (char *) malloc(declare_size);
+    char fetch[96];
+
+    snprintf(fetch, sizeof(fetch), "FETCH %d FROM %s", count, cursor->name);
+    snprintf(declare, declare_size, "DECLARE %s NO SCROLL CURSOR FOR %s", cursor->name, query);
+    const char *const *values = (const char *const *) params->values;
+    bool ok = PQenterPipelineMode(conn) &&
+              PQsendQueryParams(conn, "BEGIN", 0, NULL, NULL, NULL, NULL, 0) &&
+              PQsendQueryParams(conn, declare, params->count, NULL, values, NULL, NULL, 0) &&
+              PQsendQueryParams(conn, fetch, 0, NULL, NULL, NULL, NULL, 0) &&
+              PQpipelineSync(conn) && proxy_flush(conn);
+    free(declare);
+
+    /* results of every statement end with NULL, then the sync point gives PGRES_PIPELINE_SYNC */
+    PGresult *fetched = NULL;
+    PGresult *failed = NULL;
+    PGresult *res;
+    for (int i = 0; ok && i < 3;) {
+        if (!proxy_wait_result(conn)) {
+            ok = false;
+        } else if ((res = PQgetResult(conn)) == NULL) {
+            i++;
+        } else if (PQresultStatus(res) == PGRES_FATAL_ERROR && failed == NULL) {
+            schema_check_error(conn, res);
+            failed = res;
+        } else if (i == 2 && PQresultStatus(res) == PGRES_TUPLES_OK) {
+            fetched = res;
+        } else {
+            PQclear(res);
+        }
+    }
+    if (ok && proxy_wait_result(conn) && (res = PQgetResult(conn)) != NULL) {
+        PQclear(res);
+    }
+    PQexitPipelineMode(conn);
+
+    if (failed != NULL || fetched == NULL) {
+        PQclear(fetched);
+        return failed != NULL ? failed : PQmakeEmptyPGresult(conn, PGRES_FATAL_ERROR);
+    }
+    return fetched;
+}
+
+static PGresult *cursor_fetch(proxy_cursor_t *cursor, int count) {
+    PGconn *conn = cursor->pc->conn;
+    char fetch[96];
+
+    snprintf(fetch, sizeof(fetch), "FETCH %d FROM %s", count, cursor->name);
+    if (!PQsendQueryParams(conn, fetch, 0, NULL, NULL, NULL, NULL, cursor->result_format)) {
+        return PQmakeEmptyPGresult(conn, PGRES_FATAL_ERROR);
+    }
+    return proxy_get_last_result(conn);
+}
+
+/* closes cursors nobody asked for more rows for CURSOR_IDLE_TIMEOUT, their connections go back to the pool */
+void cursor_reap(ev_tstamp now) {
+    for (int i = 0; i < CURSOR_MAX_OPEN; i++) {
+        proxy_cursor_t *cursor = cursors[i];
+        if (cursor != NULL && !cursor->busy && now - cursor->last_used_at > CURSOR_IDLE_TIMEOUT) {
+            elog(LOG, "pg_proxy: closing idle cursor %lld on %s.%s", (long long int) cursor->id, cursor->dbname,
+                 cursor->collection);
+            /* busy while the commit waits for the server, so getMore and killCursors leave it alone */
+            cursor->busy = true;
+            cursor_close(cursor);
+        }
+    }
+}
+
+/* Checks if result column of given type can be fetched in binary format.
+   Returns true for jsonb, the only column find reads, false otherwise. */
+bool pg_binary_type_supported(Oid type) {
+    return type == JSONBOID;
+}
+
+/* BSON integers and doubles are little endian, the helpers return the position after the value */
+static unsigned char *bson_put_int32(unsigned char *p, int32 value) {
+    uint32 n = (uint32) value;
+    p[0] = (unsigned char) n;
+    p[1] = (unsigned char) (n >> 8);
+    p[2] = (unsigned char) (n >> 16);
+    p[3] = (unsigned char) (n >> 24);
+    return p + 4;
+}
+
+static unsigned char *bson_put_int64(unsigned char *p, int64 value) {
+    p = bson_put_int32(p, (int32) (uint32) ((uint64) value & 0xFFFFFFFF));
+    return bson_put_int32(p, (int32) (uint32) ((uint64) value >> 32));
+}
+
+static unsigned char *bson_put_double(unsigned char *p, double value) {
+    int64 bits;
+    memcpy(&bits, &value, sizeof(bits));
+    return bson_put_int64(p, bits);
+}
+
+/* makes room for n more bytes of the reply packet */
+static void find_reply_reserve(find_reply_t *reply, size_t n) {
+    if (reply->len + n <= reply->cap) {
+        return;
+    }
+    size_t cap = reply->cap == 0 ? 4096 : reply->cap;
+    while (cap < reply->len + n) {
+        cap *= 2;
+    }
+    reply->packet = (unsigned char *) realloc(reply->packet, cap);
+    reply->cap = cap;
+}
+
+/* writes type byte and index key of the next document of the batch, returns offset of the document length */
+static size_t find_reply_begin_document(find_reply_t *reply, size_t room) {
+    char index[16];
+    const char *key;
+    size_t key_len = bson_uint32_to_string(reply->n_docs++, &key, index, sizeof(index));
+
+    find_reply_reserve(reply, 1 + key_len + 1 + room);
+    unsigned char *p = reply->packet + reply->len;
+    *p++ = BSON_TYPE_DOCUMENT;
+    memcpy(p, key, key_len);
+    p += key_len;
+    *p++ = '\0';
+    reply->len = p - reply->packet;
+    return reply->len;
+}
+
+/* Appends document stored in jsonb column of the row to the batch.
+   Extended JSON of the stored document turns back into BSON types such as ObjectId,
+   the document is copied once into the reply packet. */
+static void find_reply_add_row(find_reply_t *reply, const PGresult *res, int row) {
+    const char *json = PQgetvalue(res, row, 0);
+    ssize_t len = PQgetlength(res, row, 0);
+    bson_error_t error;
+    bson_t doc;
+
+    /* Binary jsonb is a version byte followed by JSON text, so server does not format it */
+    if (PQfformat(res, 0) == 1) {
+        json++;
+        len--;
+    }
+
+    if (!bson_init_from_json(&doc, json, len, &error)) {
+        elog(WARNING, "Failed to convert found document to BSON: %s", error.message);
+        return;
+    }
+    size_t doc_at = find_reply_begin_document(reply, doc.len);
+    memcpy(reply->packet + doc_at, bson_get_data(&doc), doc.len);
+    reply->len = doc_at + doc.len;
+    bson_destroy(&doc);
+}
+
+/* keeps sort keys of a row appended to the batch, they are the last columns of the row */
+static void find_reply_keep_key(find_reply_t *reply, const PGresult *res, int row) {
+    int first = PQnfields(res) - reply->key_columns;
+
+    for (int i = 0; i < reply->key_columns; i++) {
+        free(reply->last_key[i]);
+        reply->last_key[i] = PQgetisnull(res, row, first + i)
+                             ? NULL : strndup(PQgetvalue(res, row, first + i), PQgetlength(res, row, first + i));
+    }
+}
+
+/**
+ * appends row of the result unless it takes the batch over FIND_MAX_BATCH_SIZE,
+ * the first row of a batch is always taken, so a large document never leaves a cursor stuck.
+ * the reply stays under maxBsonObjectSize with the few bytes of its cursor id and namespace,
+ * which keeps the message far below maxMessageSizeBytes
+ * return false if the row was left out of the batch
+ */
+static bool find_reply_add_row_bounded(find_reply_t *reply, const PGresult *res, int row) {
+    size_t len = reply->len;
+    uint32_t n_docs = reply->n_docs;
+
+    find_reply_add_row(reply, res, row);
+    if (reply->len > FIND_MAX_BATCH_SIZE && n_docs > 0) {
+        reply->len = len;
+        reply->n_docs = n_docs;
+        return false;
+    }
+    if (reply->key_columns > 0) {
+        find_reply_keep_key(reply, res, row);
+    }
+    return true;
+}
+
+/**
+ * appends up to batch_size rows of the cursor to the reply, all rows if batch_size is 0.
+ * rows are fetched CURSOR_FETCH_SIZE at most at once, so memory is spent per fetch, not per result.
+ * rows that do not fit under FIND_MAX_BATCH_SIZE are kept for the next batch
+ */
+static bool cursor_fill_batch(proxy_cursor_t *cursor, find_reply_t *reply, int batch_size) {
+    int added = 0;
+
+    for (;;) {
+        if (cursor->pending == NULL) {
+            if (cursor->exhausted) {
+                return true;
+            }
+            int count = batch_size > 0 ? Min(batch_size - added, CURSOR_FETCH_SIZE) : CURSOR_FETCH_SIZE;
+            PGresult *res = cursor_fetch(cursor, count);
+            if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+                fprintf(stderr, "FETCH command failed: %s", PQresultErrorMessage(res));
+                PQclear(res);
+                return false;
+            }
+            cursor->exhausted = PQntuples(res) < count;
+            cursor->pending = res;
+            cursor->pending_row = 0;
+        }
+
+        while (cursor->pending_row < PQntuples(cursor->pending) && (batch_size <= 0 || added < batch_size)) {
+            if (!find_reply_add_row_bounded(reply, cursor->pending, cursor->pending_row)) {
+                /* the row starts the next batch */
+                return true;
+            }
+            cursor->pending_row++;
+            added++;
+        }
+        if (cursor->pending_row == PQntuples(cursor->pending)) {
+            PQclear(cursor->pending);
+            cursor->pending = NULL;
+        }
+        if (batch_size > 0 && added >= batch_size) {
+            return true;
+        }
+    }
+}
+
+/* reads the whole result with one query, for finds whose rows all go into the first batch */
+static bool find_streamed(PGconn *conn, const char *table_name, const char *query, const query_params_t *params,
+                          find_reply_t *reply) {
+    proxy_stream_t stream;
+    if (!proxy_stream_begin(&stream, conn, query, params, true)) {
+        return false;
+    }
+
+    /* rows are encoded as they arrive, so only the reply grows with the result */
+    bool ok = true;
+    bool full = false;
+    PGresult *res;
+    while (ok && !full && (res = proxy_stream_next(&stream)) != NULL) {
+        ExecStatusType status = PQresultStatus(res);
+        if (status != PGRES_SINGLE_TUPLE && status != PGRES_TUPLES_OK) {
+            fprintf(stderr, "SELECT command failed: %s", PQresultErrorMessage(res));
+            ok = false;
+        }
+        for (int i = 0; ok && !full && i < PQntuples(res); i++) {
+            full = !find_reply_add_row_bounded(reply, res, i);
+        }
+        PQclear(res);
+    }
+    if (full) {
+        elog(WARNING, "singleBatch find on %s reached %d bytes, the rest of rows is not returned", table_name,
+             FIND_MAX_BATCH_SIZE);
+    }
+
+    proxy_stream_close(&stream);
+    return ok;
+}
+
+/**
+ * opens portal of the query for the cursor and fills the first batch from it.
+ * the cursor stays open if rows are left, otherwise it is closed and the reply gets cursor id 0
+ */
+static bool find_with_cursor(proxy_cursor_t *cursor, const char *query, const query_params_t *params,
+                             int batch_size, find_reply_t *reply) {
+    int count = batch_size > 0 ? Min(batch_size, CURSOR_FETCH_SIZE) : CURSOR_FETCH_SIZE;
+    PGresult *res = cursor_open(cursor, query, params, count);
+    if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+        fprintf(stderr, "Failed to open cursor: %s", PQresultErrorMessage(res));
+        PQclear(res);
+        cursor_close(cursor);
+        return false;
+    }
+
+    /* the first rows come as text, types of their columns decide the format of next fetches */
+    cursor->result_format = 1;
+    for (int i = 0; i < PQnfields(res); i++) {
+        if (!pg_binary_type_supported(PQftype(res, i))) {
+            cursor->result_format = 0;
+        }
+    }
+    cursor->exhausted = PQntuples(res) < count;
+    cursor->pending = res;
+    cursor->pending_row = 0;
+
+    if (PQntuples(res) == 0) {
+        PQclear(cursor->pending);
+        cursor->pending = NULL;
+    }
+
+    /* batchSize 0 asks for the cursor only, all of its rows wait for getMore */
+    bool ok = batch_size == 0 || cursor_fill_batch(cursor, reply, batch_size);
+    if (!ok || (cursor->exhausted && cursor->pending == NULL)) {
+        cursor_close(cursor);
+        return ok;
+    }
+    reply->cursor_id = cursor->id;
+    cursor->busy = false;
+    cursor->last_used_at = ev_now(ev_default_loop(0));
+    return true;
+}
+
+static keyset_t keysets[KEYSET_CACHE_SIZE];
+static uint64 keyset_writes;  /* counts keyset_invalidate, a find that saw a write while it ran remembers nothing */
+
+/**
+ * finds remembered sort keys of the statement with the largest end not past skip, the page starts after them.
+ * return NULL if no page of the statement ended before skip
+ */
+static keyset_t *keyset_find(const char *signature, int64 skip) {
+    ev_tstamp now = ev_now(ev_default_loop(0));
+    keyset_t *found = NULL;
+
+    for (int i = 0; i < KEYSET_CACHE_SIZE; i++) {
+        keyset_t *keyset = &keysets[i];
+        if (keyset->signature == NULL || now - keyset->used_at > KEYSET_TTL || keyset->end > skip ||
+            strcmp(keyset->signature, signature) != 0) {
+            continue;
+        }
+        if (found == NULL || keyset->end > found->end) {
+            found = keyset;
+        }
+    }
+    if (found != NULL) {
+        found->used_at = now;
+    }
+    return found;
+}
+
+/* remembers sort keys of the last row of the reply for the page that starts at end, in the slot used longest ago */
+static void keyset_remember(const char *signature, const char *dbname, const char *table_name, int64 end,
+                            const find_reply_t *reply) {
+    keyset_t *slot = &keysets[0];
+
+    for (int i = 0; i < KEYSET_CACHE_SIZE; i++) {
+        keyset_t *keyset = &keysets[i];
+        if (keyset->signature != NULL && keyset->end == end && strcmp(keyset->signature, signature) == 0) {
+            slot = keyset;
+            break;
+        }
+        if (keyset->used_at < slot->used_at) {
+            slot = keyset;
+        }
+    }
+
+    free(slot->signature);
+    for (int i = 0; i < slot->n_values; i++) {
+        free(slot->values[i]);
+    }
+    slot->signature = strdup(signature);
+    snprintf(slot->dbname, sizeof(slot->dbname), "%s", dbname);
+    snprintf(slot->table_name, sizeof(slot->table_name), "%s", table_name);
+    slot->end = end;
+    slot->n_values = reply->key_columns;
+    for (int i = 0; i < reply->key_columns; i++) {
+        slot->values[i] = reply->last_key[i] != NULL ? strdup(reply->last_key[i]) : NULL;
+    }
+    slot->used_at = ev_now(ev_default_loop(0));
+}
+
+/* Forgets sort keys remembered for pages of the table, called after every insert, update and delete of the worker:
+   rows written before a remembered key move the pages after it, and skip would depend on what the cache holds.
+   Writes through other workers and other sessions are not seen here, keys remembered before them are used
+   until KEYSET_TTL ends them, so meanwhile a page may start a few rows off from where OFFSET would start it. */
+void keyset_invalidate(const char *dbname, const char *table_name) {
+    keyset_writes++;
+    for (int i = 0; i < KEYSET_CACHE_SIZE; i++) {
+        keyset_t *keyset = &keysets[i];
+        if (keyset->signature == NULL || strcmp(keyset->dbname, dbname) != 0 ||
+            strcmp(keyset->table_name, table_name) != 0) {
+            continue;
+        }
+        free(keyset->signature);
+        keyset->signature = NULL;
+        for (int j = 0; j < keyset->n_values; j++) {
+            free(keyset->values[j]);
+        }
+        keyset->n_values = 0;
+        keyset->used_at = 0;
+    }
+}
+
+/* appends expression of the key, operator and value as parameter */
+static void sort_key_compare(const sort_key_t *key, const char *op, const char *value, char *condition,
+                             size_t size, query_params_t *params) {
+    strncat(condition, key->expr, size - strlen(condition) - 1);
+    strncat(condition, op, size - strlen(condition) - 1);
+    query_add_param(params, condition, size, value);
+    strncat(condition, key->cast, size - strlen(condition) - 1);
+}
+
+/**
+ * appends condition of rows that sort after the remembered keys. ascending keys without NULLs are one
+ * row comparison (a, id) > ($1, $2), which btree index of the leading key serves as a range,
+ * others are compared key by key with the NULL order of find: NULLs first when ascending, last when descending
+ */
+static void keyset_condition(const sort_key_t *keys, int n_keys, const keyset_t *keyset, char *condition,
+                             size_t size, query_params_t *params) {
+    bool row_compare = true;
+
+    for (int i = 0; i < n_keys; i++) {
+        row_compare = row_compare && !keys[i].desc && keyset->values[i] != NULL;
+    }
+
+    if (row_compare) {
+        strncat(condition, "((", size - strlen(condition) - 1);
+        for (int i = 0; i < n_keys; i++) {
+            strncat(condition, i > 0 ? ", " : "", size - strlen(condition) - 1);
+            strncat(condition, keys[i].expr, size - strlen(condition) - 1);
+        }
+        strncat(condition, ") > (", size - strlen(condition) - 1);
+        for (int i = 0; i < n_keys; i++) {
+            strncat(condition, i > 0 ? ", " : "", size - strlen(condition) - 1);
+            query_add_param(params, condition, size, keyset->values[i]);
+            strncat(condition, keys[i].cast, size - strlen(condition) - 1);
+        }
+        strncat(condition, "))", size - strlen(condition) - 1);
+        return;
+    }
+
+    /* a row is after the keys if it is after them in the first key, or equal in it and after them in the rest */
+    for (int i = 0; i < n_keys; i++) {
+        const sort_key_t *key = &keys[i];
+        const char *value = keyset->values[i];
+
+        strncat(condition, "(", size - strlen(condition) - 1);
+        if (value == NULL) {
+            strncat(condition, key->desc ? "FALSE" : key->expr, size - strlen(condition) - 1);
+            strncat(condition, key->desc ? "" : " IS NOT NULL", size - strlen(condition) - 1);
+        } else if (key->desc) {
+            strncat(condition, "(", size - strlen(condition) - 1);
+            sort_key_compare(key, " < ", value, condition, size, params);
+            strncat(condition, " OR ", size - strlen(condition) - 1);
+            strncat(condition, key->expr, size - strlen(condition) - 1);
+            strncat(condition, " IS NULL)", size - strlen(condition) - 1);
+        } else {
+            sort_key_compare(key, " > ", value, condition, size, params);
+        }
+        if (i == n_keys - 1) {
+            strncat(condition, ")", size - strlen(condition) - 1);
+            break;
+        }
+
+        strncat(condition, " OR (", size - strlen(condition) - 1);
+        if (value == NULL) {
+            strncat(condition, key->expr, size - strlen(condition) - 1);
+            strncat(condition, " IS NULL", size - strlen(condition) - 1);
+        } else {
+            sort_key_compare(key, " = ", value, condition, size, params);
+        }
+        strncat(condition, " AND ", size - strlen(condition) - 1);
+    }
+    for (int i = 0; i < n_keys - 1; i++) {
+        strncat(condition, "))", size - strlen(condition) - 1);
+    }
+}
+
+/* statement without the paging and values of its parameters, pages of one sorted find share it */
+static char *keyset_signature(const char *dbname, const char *statement, const query_params_t *params) {
+    size_t len = strlen(dbname) + strlen(statement) + 2;
+    for (int i = 0; i < params->count; i++) {
+        len += (params->values[i] != NULL ? strlen(params->values[i]) : 0) + 2;
+    }
+
+    char *signature = (char *) malloc(len + 1);
+    snprintf(signature, len + 1, "%s\x1f%s", dbname, statement);
+    for (int i = 0; i < params->count; i++) {
+        /* NULL parameters differ from empty strings */
+        strcat(signature, params->values[i] != NULL ? "\x1f" : "\x1e");
+        strcat(signature, params->values[i] != NULL ? params->values[i] : "");
+    }
+    return signature;
+}
+
+/* Builds keys of find sort document, {a: 1, "b.c": -1} orders by data->'a' and then by data->'b'->'c' descending.
+   Values compare as jsonb, numbers by value and strings by collation, types of the values ordered by jsonb.
+   The row id is the last key, so rows of equal sort keys come in one order on every page,
+   a btree index of createIndexes on the first keys supplies the order and the last one is sorted incrementally.
+   Returns false for sort values other than 1 and -1 and for too many keys. */
+static bool build_sort_keys(const bson_t *sort, sort_key_t *keys, int *n_keys) {
+    bson_iter_t iter;
+
+    *n_keys = 0;
+    if (!bson_iter_init(&iter, sort)) {
+        return false;
+    }
+    while (bson_iter_next(&iter)) {
+        const char *path = bson_iter_key(&iter);
+
+        if (!BSON_ITER_HOLDS_NUMBER(&iter) || (bson_iter_as_int64(&iter) != 1 && bson_iter_as_int64(&iter) != -1)) {
+            fprintf(stderr, "Unsupported sort of %s\n", path);
+            return false;
+        }
+        if (*n_keys == FIND_SORT_MAX_KEYS) {
+            fprintf(stderr, "Sort has more than %d keys\n", FIND_SORT_MAX_KEYS);
+            return false;
+        }
+
+        sort_key_t *key = &keys[(*n_keys)++];
+        jsonb_path_expression(key->expr, sizeof(key->expr), path);
+        key->cast = "::jsonb";
+        key->desc = bson_iter_as_int64(&iter) < 0;
+    }
+
+    if (*n_keys > 0) {
+        snprintf(keys[*n_keys].expr, sizeof(keys[*n_keys].expr), "_id");
+        keys[*n_keys].cast = "";
+        keys[*n_keys].desc = false;
+        (*n_keys)++;
+    }
+    return true;
+}
+
+/* Builds select expression of find from projection document, it is named data like the column it replaces.
+   {a: 1, b: 1} keeps keys a, b and _id in one pass over jsonb_each of the stored document,
+   {a: 0} removes top level keys by jsonb - text[] and dotted paths by #-. Dotted inclusions keep
+   their whole top level field. Keys and paths are parameters, so the statement depends on their number only.
+   Returns false for projection expressions and for inclusion mixed with exclusion. */
+static bool build_jsonb_projection(const bson_t *projection, char *select, size_t size, query_params_t *params) {
+    bson_iter_t iter;
+    int mode = 0;     /* 1 for inclusion, -1 for exclusion of the fields other than _id */
+    int id_mode = 0;  /* _id is included unless the projection excludes it */
+    char *keys = NULL;
+    size_t keys_len = 0;
+
+    if (!bson_iter_init(&iter, projection)) {
+        return false;
+    }
+    while (bson_iter_next(&iter)) {
+        const char *key = bson_iter_key(&iter);
+        bson_type_t type = bson_iter_type(&iter);
+
+        if (type != BSON_TYPE_BOOL && type != BSON_TYPE_INT32 && type != BSON_TYPE_INT64 &&
+            type != BSON_TYPE_DOUBLE) {
+            fprintf(stderr, "Unsupported projection of %s\n", key);
+            return false;
+        }
+
+        int field_mode = bson_iter_as_bool(&iter) ? 1 : -1;
+        if (strcmp(key, "_id") == 0) {
+            id_mode = field_mode;
+        } else if (mode != 0 && mode != field_mode) {
+            fprintf(stderr, "Projection mixes inclusion and exclusion\n");
+            return false;
+        } else {
+            mode = field_mode;
+        }
+    }
+
+    /* A projection of _id alone includes or excludes it only */
+    if (mode == 0) {
+        mode = id_mode;
+    }
+    if (mode == 0) {
+        snprintf(select, size, "data");
+        return true;
+    }
+
+    if (id_mode == 0 ? mode > 0 : id_mode == mode) {
+        keys = pg_array_add(keys, &keys_len, "_id");
+    }
+
+    if (mode > 0) {
+        bson_iter_init(&iter, projection);
+        while (bson_iter_next(&iter)) {
+            const char *key = bson_iter_key(&iter);
+            const char *dot = strchr(key, '.');
+            char name[BUFFER_SIZE];
+
+            if (strcmp(key, "_id") == 0) {
+                continue;
+            }
+            snprintf(name, sizeof(name), "%.*s", (int) (dot != NULL ? (size_t) (dot - key) : strlen(key)), key);
+            keys = pg_array_add(keys, &keys_len, name);
+        }
+        keys = pg_array_end(keys, keys_len);
+
+        snprintf(select, size, "(SELECT COALESCE(jsonb_object_agg(key, value), '{}'::jsonb) "
+                               "FROM jsonb_each(data) WHERE key = ANY(");
+        query_add_param(params, select, size, keys);
+        strncat(select, "::text[])) AS data", size - strlen(select) - 1);
+        free(keys);
+        return true;
+    }
+
+    /* Top level keys are removed at once, every dotted path by an operator of its own */
+    bson_iter_init(&iter, projection);
+    while (bson_iter_next(&iter)) {
+        const char *key = bson_iter_key(&iter);
+        if (strcmp(key, "_id") != 0 && strchr(key, '.') == NULL) {
+            keys = pg_array_add(keys, &keys_len, key);
+        }
+    }
+    keys = pg_array_end(keys, keys_len);
+
+    snprintf(select, size, "(data - ");
+    query_add_param(params, select, size, keys);
+    strncat(select, "::text[]", size - strlen(select) - 1);
+    free(keys);
+
+    bson_iter_init(&iter, projection);
+    while (bson_iter_next(&iter)) {
+        const char *key = bson_iter_key(&iter);
+        char *path = NULL;
+        size_t path_len = 0;
+
+        if (strchr(key, '.') == NULL) {
+            continue;
+        }
+        char *key_copy = strdup(key);
+        for (char *token = strtok(key_copy, "."); token != NULL; token = strtok(NULL, ".")) {
+            path = pg_array_add(path, &path_len, token);
+        }
+        free(key_copy);
+        path = pg_array_end(path, path_len);
+
+        strncat(select, " #- ", size - strlen(select) - 1);
+        query_add_param(params, select, size, path);
+        strncat(select, "::text[]", size - strlen(select) - 1);
+        free(path);
+    }
+    strncat(select, ") AS data", size - strlen(select) - 1);
+    return true;
+}
+
+/* Executes find query on specified table with given filter conditions.
+   Appends found documents to firstBatch of the reply. */
+bool
+execute_find_query(pooled_conn_t *pc, const char *dbname, const char *table_name, const bson_t *find,
+                   find_reply_t *reply) {
+    bson_t filter, projection, sort;
+    bson_iter_t iter;
+    char condition[BUFFER_SIZE] = "";
+    char select[BUFFER_SIZE] = "data";
+    sort_key_t keys[FIND_SORT_MAX_KEYS + 1];
+    int n_keys = 0;
+    int64 skip = 0;
+    query_params_t params = {0};
+    int limit = -1;
+    int batch_size = FIND_FIRST_BATCH_SIZE;
+    bool single_batch = false;
+
+    /* Filter becomes containment, jsonpath and range conditions, values are parameters */
+    if (bson_find_document(find, "filter", &filter) &&
+        !build_jsonb_filter_condition(&filter, condition, sizeof(condition), &params)) {
+        find_reply_error(reply, 2, "BadValue", "unsupported query operator or value in filter");
+        query_params_free(&params);
+        pool_release(pc);
+        return false;
+    }
+
+    /* Projection is applied by the server, only the requested keys are sent and encoded */
+    if (bson_find_document(find, "projection", &projection) &&
+        !build_jsonb_projection(&projection, select, sizeof(select), &params)) {
+        find_reply_error(reply, 2, "BadValue", "unsupported projection");
+        query_params_free(&params);
+        pool_release(pc);
+        return false;
+    }
+
+    /* Sort becomes ORDER BY with the NULL order of find, skip is OFFSET */
+    if (bson_find_document(find, "sort", &sort) && !build_sort_keys(&sort, keys, &n_keys)) {
+        find_reply_error(reply, 2, "BadValue", "unsupported sort");
+        query_params_free(&params);
+        pool_release(pc);
+        return false;
+    }
+    if (bson_iter_init_find(&iter, find, "skip")) {
+        skip = bson_iter_as_int64(&iter);
+        if (skip < 0) {
+            find_reply_error(reply, 2, "BadValue", "skip must be a nonnegative number");
+            query_params_free(&params);
+            pool_release(pc);
+            return false;
+        }
+    }
+
+    /* Parse limit and batching from the command */
+    if (bson_iter_init_find(&iter, find, "limit")) {
+        limit = (int) bson_iter_as_int64(&iter);
+    }
+    if (bson_iter_init_find(&iter, find, "batchSize")) {
+        batch_size = (int) bson_iter_as_int64(&iter);
+        if (batch_size < 0) {
+            elog(WARNING, "pg_proxy: negative batchSize %d of find on %s, the default one is used", batch_size,
+                 table_name);
+            batch_size = FIND_FIRST_BATCH_SIZE;
+        }
+    }
+    if (bson_iter_init_find(&iter, find, "singleBatch")) {
+        single_batch = bson_iter_as_bool(&iter);
+    }
+
+    /* Sort keys are selected after the columns of the documents, the batch remembers them of its last row */
+    char order_by[BUFFER_SIZE] = "";
+    for (int i = 0; i < n_keys; i++) {
+        strncat(order_by, i == 0 ? " ORDER BY " : ", ", sizeof(order_by) - strlen(order_by) - 1);
+        strncat(order_by, keys[i].expr, sizeof(order_by) - strlen(order_by) - 1);
+        strncat(order_by, keys[i].desc ? " DESC NULLS LAST" : " NULLS FIRST",
+                sizeof(order_by) - strlen(order_by) - 1);
+        snprintf(select + strlen(select), sizeof(select) - strlen(select), "%s(%s)::text",
+                 strlen(select) > 0 ? ", " : "", keys[i].expr);
+    }
+    reply->key_columns = n_keys;
+
+    /* A page of a sorted find starts after the sort keys of the page before it when they are remembered,
+       so the rows before it are not read again only to be skipped. */
+    char *signature = NULL;
+    int64 offset = skip;
+    uint64 writes_before = keyset_writes;
+    if (n_keys > 0) {
+        char statement[BUFFER_SIZE * 2];
+        snprintf(statement, sizeof(statement), "SELECT %s FROM %s WHERE %s%s", select, table_name, condition,
+                 order_by);
+        signature = keyset_signature(dbname, statement, &params);
+
+        keyset_t *keyset = skip > 0 ? keyset_find(signature, skip) : NULL;
+        if (keyset != NULL) {
+            if (strlen(condition) > 0) {
+                strncat(condition, " AND ", sizeof(condition) - strlen(condition) - 1);
+            }
+            keyset_condition(keys, n_keys, keyset, condition, sizeof(condition), &params);
+            offset = skip - keyset->end;
+        }
+    }
+
+    /* Only presence of the limit and the offset changes the statement, their values are parameters */
+    char limit_clause[64] = "";
+    char limit_str[16];
+    char offset_str[24];
+    if (limit > 0) {
+        snprintf(limit_str, sizeof(limit_str), "%d", limit);
+        strcat(limit_clause, " LIMIT ");
+        query_add_param(&params, limit_clause, sizeof(limit_clause), limit_str);
+    }
+    if (offset > 0) {
+        snprintf(offset_str, sizeof(offset_str), "%lld", (long long int) offset);
+        strcat(limit_clause, " OFFSET ");
+        query_add_param(&params, limit_clause, sizeof(limit_clause), offset_str);
+    }
+
+    char query[BUFFER_SIZE * 3];
+    if (strlen(condition) > 0) {
+        snprintf(query, sizeof(query), "SELECT %s FROM %s WHERE %s%s%s", select, table_name, condition, order_by,
+                 limit_clause);
+    } else {
+        snprintf(query, sizeof(query), "SELECT %s FROM %s%s%s", select, table_name, order_by, limit_clause);
+    }
+
+    /* singleBatch is streamed and ends with the first batch, other finds are read through a cursor,
+       so rows that do not fit into a full batch are left for getMore even under a limit */
+    proxy_cursor_t *cursor = single_batch ? NULL : cursor_create(pc, dbname, table_name);
+    if (!single_batch && cursor == NULL) {
+        /* a single batch would end the result early behind cursor id 0 */
+        find_reply_error(reply, 1, "InternalError", "too many open cursors");
+        pool_release(pc);
+        query_params_free(&params);
+        free(signature);
+        return false;
+    }
+
+    find_reply_begin(reply, "firstBatch");
+    bool ok = cursor != NULL ? find_with_cursor(cursor, query, &params, batch_size, reply)
+                             : find_streamed(pc->conn, table_name, query, &params, reply);
+    if (cursor == NULL) {
+        pool_release(pc);
+    }
+    query_params_free(&params);
+
+    /* the next page starts past the last row of the first batch */
+    if (signature != NULL) {
+        if (ok && reply->n_docs > 0 && keyset_writes == writes_before) {
+            keyset_remember(signature, dbname, table_name, skip + reply->n_docs, reply);
+        }
+        free(signature);
+    }
+    return ok;
+}
+
+/* Connects to database, checks and creates required table if it doesn't exist,
+   and executes find command of the message.
+   Builds the reply and returns true if operation was successful, false otherwise. */
+bool execute_query_find_to_postgres(const mongo_msg_t *msg, find_reply_t *reply, char **collection, char **dbname) {
+    const char *find_collection, *find_dbname;
+    if (!command_target(msg, "find", &find_collection, &find_dbname)) {
+        fprintf(stderr, "Invalid find command\n");
+        return false;
+    }
+
+    strcpy(*collection, find_collection);
+    strcpy(*dbname, find_dbname);
+    elog(WARNING, "EXECUTE_QUERY_FIND_TO_POSTGRES: line: %d dbname: %s collection: %s", __LINE__, *dbname, *collection);
+
+    pooled_conn_t *pc = pool_acquire(*dbname);
+    if (pc == NULL) {
+        fprintf(stderr, "Failed to get connection to database %s\n", *dbname);
+        return false;
+    }
+    PGconn *conn = pc->conn;
+
+    if (!check_and_create_table(conn, *collection)) {
+        fprintf(stderr, "Failed to create or check table\n");
+        pool_release(pc);
+        return false;
+    }
+
+    /* the connection is released by execute_find_query or kept by the cursor it opens */
+    if (!execute_find_query(pc, *dbname, *collection, msg->docs[0], reply)) {
+        fprintf(stderr, "Failed to execute find query\n");
+        return false;
+    }
+
+    return true;
+}
+
+/* return true if value is a field path of an aggregation expression like "$a.b" */
+static bool pipeline_field_path(const bson_iter_t *value) {
+    if (!BSON_ITER_HOLDS_UTF8(value)) {
+        return false;
+    }
+    const char *str = bson_iter_utf8(value, NULL);
+    return str[0] == '$' && str[1] != '$' && str[1] != '\0';
+}
+
+/* Appends aggregate of accumulator {op: arg} of $group. Sums and averages take numbers only and
+   min and max skip nulls and missing fields, as accumulators of mongod do.
+   Returns false for accumulators and arguments that are not supported. */
+static bool pipeline_accumulator(const bson_iter_t *accumulator, char *query, size_t size, query_params_t *params) {
+    bson_iter_t op;
+    char expr[BUFFER_SIZE];
+    char number[BUFFER_SIZE];
+
+    if (!BSON_ITER_HOLDS_DOCUMENT(accumulator) || !bson_iter_recurse(accumulator, &op) || !bson_iter_next(&op)) {
+        return false;
+    }
+    const char *name = bson_iter_key(&op);
+
+    if (strcmp(name, "$count") == 0) {
+        strncat(query, "COUNT(*)", size - strlen(query) - 1);
+        return true;
+    }
+    if (strcmp(name, "$sum") == 0 && BSON_ITER_HOLDS_NUMBER(&op)) {
+        /* {$sum: 1} counts documents, other constants are added once per document */
+        if (!BSON_ITER_HOLDS_DOUBLE(&op) && bson_iter_as_int64(&op) == 1) {
+            strncat(query, "COUNT(*)", size - strlen(query) - 1);
+        } else {
+            char *value_json = bson_value_as_json(&op);
+            strncat(query, "(COUNT(*) * ", size - strlen(query) - 1);
+            query_add_param(params, query, size, value_json);
+            strncat(query, "::numeric)", size - strlen(query) - 1);
+            bson_free(value_json);
+        }
+        return true;
+    }
+    if (!pipeline_field_path(&op)) {
+        return false;
+    }
+
+    jsonb_path_expression(expr, sizeof(expr), bson_iter_utf8(&op, NULL) + 1);
+    snprintf(number, sizeof(number), "CASE WHEN jsonb_typeof(%s) = 'number' THEN %s::numeric END", expr, expr);
+
+    char aggregate[BUFFER_SIZE * 2];
+    if (strcmp(name, "$sum") == 0) {
+        snprintf(aggregate, sizeof(aggregate), "COALESCE(SUM(%s), 0)", number);
+    } else if (strcmp(name, "$avg") == 0) {
+        snprintf(aggregate, sizeof(aggregate), "AVG(%s)::float8", number);
+    } else if (strcmp(name, "$min") == 0 || strcmp(name, "$max") == 0) {
+        /* jsonb has no min and max aggregates, its btree order sorts values of the group instead */
+        snprintf(aggregate, sizeof(aggregate),
+                 "(array_agg(%s ORDER BY %s%s) FILTER (WHERE jsonb_typeof(%s) <> 'null'))[1]",
+                 expr, expr, strcmp(name, "$max") == 0 ? " DESC" : "", expr);
+    } else {
+        return false;
+    }
+    strncat(query, aggregate, size - strlen(query) - 1);
+    return true;
+}
+
+/* Builds $group stage reading documents of from, {_id: "$a", n: {$sum: 1}} becomes
+   SELECT jsonb_build_object('_id', (data->'a'), 'n', COUNT(*)) AS data FROM (from) s GROUP BY (data->'a').
+   _id may be a field path, a document of field paths or a constant that puts all documents in one group.
+   Returns false with errmsg for keys and accumulators that are not supported. */
+static bool pipeline_group(const bson_iter_t *stage, const char *from, char *query, size_t size,
+                           query_params_t *params, char *errmsg, size_t errmsg_size) {
+    bson_iter_t iter, child;
+    char group_by[BUFFER_SIZE] = "";
+    int n_fields = 0;
+
+    if (!BSON_ITER_HOLDS_DOCUMENT(stage) || !bson_iter_recurse(stage, &iter) || !bson_iter_find(&iter, "_id")) {
+        snprintf(errmsg, errmsg_size, "$group needs an _id");
+        return false;
+    }
+
+    snprintf(query, size, "SELECT jsonb_build_object('_id', ");
+    if (pipeline_field_path(&iter)) {
+        jsonb_path_expression(group_by, sizeof(group_by), bson_iter_utf8(&iter, NULL) + 1);
+    } else if (BSON_ITER_HOLDS_DOCUMENT(&iter) && bson_iter_recurse(&iter, &child)) {
+        strncat(group_by, "jsonb_build_object(", sizeof(group_by) - strlen(group_by) - 1);
+        while (bson_iter_next(&child)) {
+            char expr[BUFFER_SIZE];
+            if (!pipeline_field_path(&child)) {
+                snprintf(errmsg, errmsg_size, "_id of $group has field %s that is not a field path",
+                         bson_iter_key(&child));
+                return false;
+            }
+            jsonb_path_expression(expr, sizeof(expr), bson_iter_utf8(&child, NULL) + 1);
+            strncat(group_by, n_fields++ > 0 ? ", " : "", sizeof(group_by) - strlen(group_by) - 1);
+            sql_append_quoted(group_by, sizeof(group_by), bson_iter_key(&child), '\'');
+            strncat(group_by, ", ", sizeof(group_by) - strlen(group_by) - 1);
+            strncat(group_by, expr, sizeof(group_by) - strlen(group_by) - 1);
+        }
+        strncat(group_by, ")", sizeof(group_by) - strlen(group_by) - 1);
+    } else if (BSON_ITER_HOLDS_NULL(&iter) || (BSON_ITER_HOLDS_UTF8(&iter) && !pipeline_field_path(&iter)) ||
+               BSON_ITER_HOLDS_NUMBER(&iter) || BSON_ITER_HOLDS_BOOL(&iter)) {
+        char *value_json = bson_value_as_json(&iter);
+        query_add_param(params, query, size, value_json);
+        strncat(query, "::jsonb", size - strlen(query) - 1);
+        bson_free(value_json);
+    } else {
+        snprintf(errmsg, errmsg_size, "_id of $group is not supported");
+        return false;
+    }
+    strncat(query, group_by, size - strlen(query) - 1);
+
+    /* jsonb_build_object takes 100 arguments, _id and 49 accumulators */
+    n_fields = 1;
+    bson_iter_recurse(stage, &iter);
+    while (bson_iter_next(&iter)) {
+        const char *name = bson_iter_key(&iter);
+        if (strcmp(name, "_id") == 0) {
+            continue;
+        }
+        if (strchr(name, '.') != NULL || ++n_fields > 50) {
+            snprintf(errmsg, errmsg_size, "$group field %s is not supported", name);
+            return false;
+        }
+        strncat(query, ", ", size - strlen(query) - 1);
+        sql_append_quoted(query, size, name, '\'');
+        strncat(query, ", ", size - strlen(query) - 1);
+        if (!pipeline_accumulator(&iter, query, size, params)) {
+            snprintf(errmsg, errmsg_size, "accumulator of $group field %s is not supported", name);
+            return false;
+        }
+    }
+
+    strncat(query, ") AS data FROM (", size - strlen(query) - 1);
+    strncat(query, from, size - strlen(query) - 1);
+    if (strlen(group_by) > 0) {
+        strncat(query, ") s GROUP BY ", size - strlen(query) - 1);
+        strncat(query, group_by, size - strlen(query) - 1);
+    } else {
+        /* One group of no documents is no group, as for mongod */
+        strncat(query, ") s HAVING COUNT(*) > 0", size - strlen(query) - 1);
+    }
+    return true;
+}
+
+/* Builds source of $sample as the first stage. A table with SAMPLE_TABLE_RATIO rows per document asked is read
+   by TABLESAMPLE SYSTEM of a few times the size asked, so only a part of its blocks is read, the rest of tables
+   are read whole. Statistics of the table tell its size, a table never analyzed is read whole. */
+static void pipeline_sample_source(PGconn *conn, const char *table_name, int64 sample_size, char *query, size_t size,
+                                   query_params_t *params) {
+    const char *values[1] = {table_name};
+    PGresult *res = proxy_exec_params(conn, "SELECT reltuples::float8 FROM pg_class WHERE oid = to_regclass($1)",
+                                      1, values);
+    double rows = 0;
+
+    if (PQresultStatus(res) == PGRES_TUPLES_OK && PQntuples(res) == 1) {
+        rows = strtod(PQgetvalue(res, 0, 0), NULL);
+    }
+    PQclear(res);
+
+    snprintf(query, size, "SELECT data FROM %s", table_name);
+    if (rows > (double) sample_size * SAMPLE_TABLE_RATIO) {
+        char percent[32];
+        snprintf(percent, sizeof(percent), "%.6f", 100.0 * ((double) sample_size * 4 + SAMPLE_SPARE_ROWS) / rows);
+        strncat(query, " TABLESAMPLE SYSTEM (", size - strlen(query) - 1);
+        query_add_param(params, query, size, percent);
+        strncat(query, "::float4)", size - strlen(query) - 1);
+    }
+}
+
+/* Compiles aggregation pipeline into one statement, every stage is a subquery reading data of the stage before it.
+   The planner flattens $match and $project of the first stages into the scan of the table, so its indexes serve them.
+   $group becomes GROUP BY with aggregates, $sort, $skip and $limit ORDER BY, OFFSET and LIMIT,
+   $count a count of the rows and $sample random rows, of TABLESAMPLE when it is the first stage.
+   Returns false with errmsg for stages that are not supported. */
+static bool build_jsonb_pipeline(PGconn *conn, const char *table_name, const bson_t *pipeline, char *query,
+                                 size_t size, query_params_t *params, char *errmsg, size_t errmsg_size) {
+    bson_iter_t iter, stage;
+    char *from = (char *) malloc(size);
+    bool ok = true;
+    int n_stages = 0;
+
+    snprintf(query, size, "SELECT data FROM %s", table_name);
+    if (!bson_iter_init(&iter, pipeline)) {
+        snprintf(errmsg, errmsg_size, "invalid pipeline");
+        free(from);
+        return false;
+    }
+    while (ok && bson_iter_next(&iter)) {
+        if (!BSON_ITER_HOLDS_DOCUMENT(&iter) || !bson_iter_recurse(&iter, &stage) || !bson_iter_next(&stage)) {
+            snprintf(errmsg, errmsg_size, "pipeline stage must be a document with one field");
+            ok = false;
+            break;
+        }
+        const char *name = bson_iter_key(&stage);
+        bson_t doc;
+        const uint8_t *data;
+        uint32_t len;
+        char clause[BUFFER_SIZE];
+
+        if (BSON_ITER_HOLDS_DOCUMENT(&stage)) {
+            bson_iter_document(&stage, &len, &data);
+            bson_init_static(&doc, data, len);
+        } else {
+            bson_init(&doc);
+        }
+        snprintf(from, size, "%s", query);
+        clause[0] = '\0';
+
+        if (strcmp(name, "$match") == 0) {
+            ok = BSON_ITER_HOLDS_DOCUMENT(&stage) &&
+                 build_jsonb_filter_condition(&doc, clause, sizeof(clause), params);
+            snprintf(query, size, "SELECT data FROM (%s) s%s%s", from, clause[0] != '\0' ? " WHERE " : "", clause);
+        } else if (strcmp(name, "$project") == 0) {
+            ok = BSON_ITER_HOLDS_DOCUMENT(&stage) && build_jsonb_projection(&doc, clause, sizeof(clause), params);
+            snprintf(query, size, "SELECT %s FROM (%s) s", clause, from);
+        } else if (strcmp(name, "$sort") == 0) {
+            sort_key_t keys[FIND_SORT_MAX_KEYS + 1];
+            int n_keys = 0;
+            ok = BSON_ITER_HOLDS_DOCUMENT(&stage) && build_sort_keys(&doc, keys, &n_keys) && n_keys > 0;
+
+            /* documents of a stage have no row id, the last key is left out */
+            for (int i = 0; ok && i < n_keys - 1; i++) {
+                strncat(clause, i == 0 ? " ORDER BY " : ", ", sizeof(clause) - strlen(clause) - 1);
+                strncat(clause, keys[i].expr, sizeof(clause) - strlen(clause) - 1);
+                strncat(clause, keys[i].desc ? " DESC NULLS LAST" : " NULLS FIRST",
+                        sizeof(clause) - strlen(clause) - 1);
+            }
+            snprintf(query, size, "SELECT data FROM (%s) s%s", from, clause);
+        } else if (strcmp(name, "$skip") == 0 || strcmp(name, "$limit") == 0) {
+            ok = BSON_ITER_HOLDS_NUMBER(&stage) && bson_iter_as_int64(&stage) >= (name[1] == 'l' ? 1 : 0);
+            if (ok) {
+                char value[24];
+                snprintf(value, sizeof(value), "%lld", (long long int) bson_iter_as_int64(&stage));
+                snprintf(clause, sizeof(clause), name[1] == 'l' ? " LIMIT " : " OFFSET ");
+                query_add_param(params, clause, sizeof(clause), value);
+            }
+            snprintf(query, size, "SELECT data FROM (%s) s%s", from, clause);
+        } else if (strcmp(name, "$count") == 0) {
+            ok = BSON_ITER_HOLDS_UTF8(&stage) && bson_iter_utf8(&stage, NULL)[0] != '\0' &&
+                 bson_iter_utf8(&stage, NULL)[0] != '$' && strchr(bson_iter_utf8(&stage, NULL), '.') == NULL;
+            if (ok) {
+                sql_append_quoted(clause, sizeof(clause), bson_iter_utf8(&stage, NULL), '\'');
+            }
+            snprintf(query, size, "SELECT jsonb_build_object(%s, COUNT(*)) AS data FROM (%s) s HAVING COUNT(*) > 0",
+                     clause, from);
+        } else if (strcmp(name, "$sample") == 0) {
+            bson_iter_t size_iter;
+            ok = bson_iter_init_find(&size_iter, &doc, "size") && BSON_ITER_HOLDS_NUMBER(&size_iter) &&
+                 bson_iter_as_int64(&size_iter) > 0;
+            if (ok) {
+                char value[24];
+                if (n_stages == 0) {
+                    pipeline_sample_source(conn, table_name, bson_iter_as_int64(&size_iter), from, size, params);
+                }
+                snprintf(value, sizeof(value), "%lld", (long long int) bson_iter_as_int64(&size_iter));
+                strcat(clause, " ORDER BY random() LIMIT ");
+                query_add_param(params, clause, sizeof(clause), value);
+            }
+            snprintf(query, size, "SELECT data FROM (%s) s%s", from, clause);
+        } else if (strcmp(name, "$group") == 0) {
+            ok = pipeline_group(&stage, from, query, size, params, errmsg, errmsg_size);
+            if (!ok) {
+                break;
+            }
+        } else {
+            ok = false;
+        }
+
+        if (!ok) {
+            snprintf(errmsg, errmsg_size, "unsupported or invalid pipeline stage %s", name);
+        }
+        n_stages++;
+    }
+
+    free(from);
+    return ok;
+}
+
+/* Connects to database, checks and creates required table if it doesn't exist,
+   and runs aggregate command of the message as one statement whose result is read through a cursor.
+   Builds the reply and returns true if operation was successful, false otherwise. */
+bool execute_query_aggregate(const mongo_msg_t *msg, find_reply_t *reply, char **collection, char **dbname) {
+    const char *aggregate_collection, *aggregate_dbname;
+    bson_t pipeline;
+    bson_iter_t iter;
+    char errmsg[BUFFER_SIZE];
+    int batch_size = FIND_FIRST_BATCH_SIZE;
+
+    if (!command_target(msg, "aggregate", &aggregate_collection, &aggregate_dbname) ||
+        !bson_iter_init_find(&iter, msg->docs[0], "pipeline") || !BSON_ITER_HOLDS_ARRAY(&iter)) {
+        find_reply_error(reply, 9, "FailedToParse", "aggregate needs a collection and a pipeline");
+        return false;
+    }
+    bson_find_document(msg->docs[0], "pipeline", &pipeline);
+    if (bson_iter_init_find(&iter, msg->docs[0], "cursor") && BSON_ITER_HOLDS_DOCUMENT(&iter)) {
+        bson_iter_t batch_iter;
+        if (bson_iter_recurse(&iter, &batch_iter) && bson_iter_find(&batch_iter, "batchSize") &&
+            bson_iter_as_int64(&batch_iter) >= 0) {
+            batch_size = (int) bson_iter_as_int64(&batch_iter);
+        }
     }
 
-    PQfinish(conn);
+    strcpy(*collection, aggregate_collection);
+    strcpy(*dbname, aggregate_dbname);
 
-    /* Connect to specified database */
-    char conninfo[BUFFER_SIZE];
-    snprintf(conninfo, sizeof(conninfo), "dbname=%s user=user1 password=passwd port=5433", dbname);
-    conn = PQconnectdb(conninfo);
-    if (PQstatus(conn) != CONNECTION_OK) {
-        fprintf(stderr, "Connection to database %s failed: %s", dbname, PQerrorMessage(conn));
-        json_object_put(metadata_json);
-        PQfinish(conn);
+    pooled_conn_t *pc = pool_acquire(*dbname);
+    if (pc == NULL) {
+        find_reply_error(reply, 1, "InternalError", "no connection to the database");
         return false;
     }
-
-    /* Check and create table if it does not exist */
-    if (!check_and_create_table(conn, collection)) {
-        fprintf(stderr, "Failed to create or check table\n");
-        json_object_put(metadata_json);
-        PQfinish(conn);
+    if (!check_and_create_table(pc->conn, *collection)) {
+        find_reply_error(reply, 1, "InternalError", "failed to create or check table");
+        pool_release(pc);
         return false;
     }
 
-    /* Parse delete JSON array */
-    struct json_object *delete_array = json_tokener_parse(json_data_array);
-    if (!delete_array || json_object_get_type(delete_array) != json_type_array) {
-        fprintf(stderr, "Failed to parse delete JSON array\n");
-        json_object_put(metadata_json);
-        PQfinish(conn);
+    char *query = (char *) malloc(BUFFER_SIZE * 16);
+    query_params_t params = {0};
+    if (!build_jsonb_pipeline(pc->conn, *collection, &pipeline, query, BUFFER_SIZE * 16, &params, errmsg,
+                              sizeof(errmsg))) {
+        find_reply_error(reply, 2, "BadValue", errmsg);
+        free(query);
+        query_params_free(&params);
+        pool_release(pc);
         return false;
     }
 
-    /* Execute delete queries */
-    if (!execute_delete_queries(conn, collection, delete_array, deleted_count)) {
-        fprintf(stderr, "Failed to execute delete queries\n");
-        json_object_put(metadata_json);
-        json_object_put(delete_array);
-        PQfinish(conn);
+    /* the whole result is read through a cursor, as for a find without a limit */
+    proxy_cursor_t *cursor = cursor_create(pc, *dbname, *collection);
+    if (cursor == NULL) {
+        find_reply_error(reply, 1, "InternalError", "too many open cursors");
+        free(query);
+        query_params_free(&params);
+        pool_release(pc);
         return false;
     }
 
-    /* Clean up */
-    json_object_put(metadata_json);
-    json_object_put(delete_array);
-    PQfinish(conn);
-
-    return true;
+    find_reply_begin(reply, "firstBatch");
+    bool ok = find_with_cursor(cursor, query, &params, batch_size, reply);
+    free(query);
+    query_params_free(&params);
+    if (!ok) {
+        find_reply_error(reply, 1, "InternalError", "failed to run the pipeline");
+    }
+    return ok;
 }
 
-/* Builds JSONPath condition from given JSON object.
-   Appends condition to jsonpath_condition. */
-void build_jsonb_path_condition(struct json_object *q_json, char *jsonpath_condition) {
-    strcat(jsonpath_condition, "$.** ? (");
+/**
+ * serves getMore: appends next batch of the cursor to the reply, the cursor is closed once its rows run out.
+ * return false with an error in the reply if the cursor is unknown or its rows could not be fetched
+ */
+bool execute_query_getmore(const mongo_msg_t *msg, find_reply_t *reply, char **collection, char **dbname) {
+    bson_iter_t iter;
+    int64 id = 0;
+    int batch_size = 0;
+    char errmsg[256];
+
+    if (msg->count > 0 && bson_iter_init_find(&iter, msg->docs[0], "getMore")) {
+        id = bson_iter_as_int64(&iter);
+    }
+    if (msg->count > 0 && bson_iter_init_find(&iter, msg->docs[0], "batchSize")) {
+        batch_size = (int) bson_iter_as_int64(&iter);
+    }
 
-    json_object_object_foreach(q_json, key, val)
-    {
-        char condition_part[BUFFER_SIZE];
-        snprintf(condition_part, sizeof(condition_part), "@.%s == \"%s\" && ", key, json_object_get_string(val));
-        strncat(jsonpath_condition, condition_part, sizeof(jsonpath_condition) - strlen(jsonpath_condition) - 1);
+    proxy_cursor_t *cursor = cursor_find(id);
+    if (cursor == NULL && id > 0 && (int) (id >> CURSOR_WORKER_SHIFT) != worker_index) {
+        /* cursors are not shared between workers, a driver may send getMore on a connection another worker accepted */
+        snprintf(errmsg, sizeof(errmsg),
+                 "cursor id %lld was opened by proxy worker %d, getMore reached worker %d; "
+                 "cursors need pg_proxy.workers = 1", (long long int) id, (int) (id >> CURSOR_WORKER_SHIFT),
+                 worker_index);
+        find_reply_error(reply, 43, "CursorNotFound", errmsg);
+        return false;
+    }
+    if (cursor == NULL || cursor->busy) {
+        snprintf(errmsg, sizeof(errmsg), "cursor id %lld not found", (long long int) id);
+        find_reply_error(reply, 43, "CursorNotFound", errmsg);
+        return false;
+    }
+    strcpy(*collection, cursor->collection);
+    strcpy(*dbname, cursor->dbname);
+
+    cursor->busy = true;
+    find_reply_begin(reply, "nextBatch");
+    bool ok = cursor_fill_batch(cursor, reply, batch_size);
+    if (!ok || (cursor->exhausted && cursor->pending == NULL)) {
+        cursor_close(cursor);
+    } else {
+        reply->cursor_id = cursor->id;
+        cursor->busy = false;
+        cursor->last_used_at = ev_now(ev_default_loop(0));
     }
 
-    /* Remove trailing " && " and close condition */
-    jsonpath_condition[strlen(jsonpath_condition) - 4] = '\0';
-    strncat(jsonpath_condition, ")", sizeof(jsonpath_condition) - strlen(jsonpath_condition) - 1);
+    if (!ok) {
+        snprintf(errmsg, sizeof(errmsg), "failed to fetch rows of cursor id %lld", (long long int) id);
+        find_reply_error(reply, 1, "InternalError", errmsg);
+    }
+    return ok;
 }
 
-/* Builds JSON path from given key.
-   Appends path to provided path variable. */
-void build_jsonb_path(const char *key, char *path) {
-    const char *delimiter = ".";
-    char *key_copy = strdup(key);
-    char *token = strtok(key_copy, delimiter);
+/* appends value to BSON array whose next index is *n */
+static void bson_array_add_int64(bson_t *array, uint32_t *n, int64 value) {
+    char index[16];
+    const char *key;
+    size_t key_len = bson_uint32_to_string((*n)++, &key, index, sizeof(index));
+    bson_append_int64(array, key, (int) key_len, value);
+}
 
-    while (token != NULL) {
-        strcat(path, "\"");
-        strcat(path, token);
-        strcat(path, "\", ");
-        token = strtok(NULL, delimiter);
+/* serves killCursors: closes listed cursors and tells which of them were killed */
+void execute_query_killcursors(const mongo_msg_t *msg, find_reply_t *reply) {
+    bson_t killed = BSON_INITIALIZER;
+    bson_t not_found = BSON_INITIALIZER;
+    bson_t alive = BSON_INITIALIZER;
+    bson_t unknown = BSON_INITIALIZER;
+    uint32_t n_killed = 0, n_not_found = 0, n_alive = 0;
+    bson_iter_t iter, ids;
+
+    if (msg->count > 0 && bson_iter_init_find(&iter, msg->docs[0], "cursors") && BSON_ITER_HOLDS_ARRAY(&iter) &&
+        bson_iter_recurse(&iter, &ids)) {
+        while (bson_iter_next(&ids)) {
+            int64 id = bson_iter_as_int64(&ids);
+            proxy_cursor_t *cursor = cursor_find(id);
+            if (cursor == NULL) {
+                bson_array_add_int64(&not_found, &n_not_found, id);
+            } else if (cursor->busy) {
+                /* a getMore of the cursor is waiting for rows, the idle timeout closes it later */
+                bson_array_add_int64(&alive, &n_alive, id);
+            } else {
+                cursor_close(cursor);
+                bson_array_add_int64(&killed, &n_killed, id);
+            }
+        }
     }
 
-    /* Remove trailing comma and space */
-    path[strlen(path) - 2] = '\0';
-
-    free(key_copy);
+    bson_append_array(&reply->body, "cursorsKilled", -1, &killed);
+    bson_append_array(&reply->body, "cursorsNotFound", -1, &not_found);
+    bson_append_array(&reply->body, "cursorsAlive", -1, &alive);
+    bson_append_array(&reply->body, "cursorsUnknown", -1, &unknown);
+    bson_append_double(&reply->body, "ok", -1, 1.0);
+    bson_destroy(&killed);
+    bson_destroy(&not_found);
+    bson_destroy(&alive);
+    bson_destroy(&unknown);
 }
 
-/* Executes update queries for each JSON object in update array from specified table.
-   Updates updated count and returns true if all updates were successful, false otherwise. */
-bool
-execute_update_queries(PGconn *conn, const char *table_name, struct json_object *update_array, int *updated_count) {
-    int array_length = json_object_array_length(update_array);
-    *updated_count = 0;
-
-    for (int i = 0; i < array_length; i++) {
-        struct json_object *update_json = json_object_array_get_idx(update_array, i);
-        struct json_object *q_json, *u_json, *multi_json;
+/* Specs of indexes created through the proxy are kept as comments of the PostgreSQL indexes,
+   the primary key stands for the _id_ index. No rows are returned when the table does not exist. */
+static const char *const index_specs_query =
+        "SELECT spec, index_name FROM ("
+        "SELECT 0::bigint AS n, '{\"v\": 2, \"key\": {\"_id\": 1}, \"name\": \"_id_\"}'::text AS spec, "
+        "NULL::text AS index_name WHERE to_regclass($1) IS NOT NULL "
+        "UNION ALL "
+        "SELECT c.oid::bigint, d.description, c.relname::text FROM pg_index i "
+        "JOIN pg_class c ON c.oid = i.indexrelid "
+        "JOIN pg_description d ON d.objoid = i.indexrelid AND d.classoid = 'pg_class'::regclass AND d.objsubid = 0 "
+        "WHERE i.indrelid = to_regclass($1) AND d.description LIKE '{%') specs ORDER BY n";
+
+/* Returns specs of indexes of the table, NULL if they could not be read. */
+static PGresult *index_specs(PGconn *conn, const char *table_name) {
+    const char *values[1] = {table_name};
+    PGresult *res = proxy_exec_params(conn, index_specs_query, 1, values);
 
-        /* Validate update JSON format */
-        if (!json_object_object_get_ex(update_json, "q", &q_json) ||
-            !json_object_object_get_ex(update_json, "u", &u_json)) {
-            fprintf(stderr, "Invalid update JSON format at index %d\n", i);
-            return false;
-        }
+    if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+        fprintf(stderr, "Failed to list indexes of %s: %s", table_name, PQresultErrorMessage(res));
+        PQclear(res);
+        return NULL;
+    }
+    return res;
+}
 
-        const char *q_str = json_object_to_json_string_ext(q_json, JSON_C_TO_STRING_PLAIN);
+/* name mongod gives an index without one, field and direction of every key joined with '_' */
+static void index_default_name(const bson_t *key, char *name, size_t size) {
+    bson_iter_t iter;
+    char part[256];
 
-        /* Validate $set JSON format */
-        struct json_object *set_json;
-        if (!json_object_object_get_ex(u_json, "$set", &set_json)) {
-            fprintf(stderr, "Invalid $set JSON format at index %d\n", i);
-            return false;
+    name[0] = '\0';
+    if (!bson_iter_init(&iter, key)) {
+        return;
+    }
+    while (bson_iter_next(&iter)) {
+        if (BSON_ITER_HOLDS_UTF8(&iter)) {
+            snprintf(part, sizeof(part), "%s%s_%s", name[0] != '\0' ? "_" : "", bson_iter_key(&iter),
+                     bson_iter_utf8(&iter, NULL));
+        } else {
+            snprintf(part, sizeof(part), "%s%s_%lld", name[0] != '\0' ? "_" : "", bson_iter_key(&iter),
+                     (long long int) bson_iter_as_int64(&iter));
         }
+        strncat(name, part, size - strlen(name) - 1);
+    }
+}
 
-        /* Initialize jsonb_set_clause */
-        char jsonb_set_clause[BUFFER_SIZE * 10] = "";
-        struct json_object_iterator it = json_object_iter_begin(set_json);
-        struct json_object_iterator it_end = json_object_iter_end(set_json);
-
-        while (!json_object_iter_equal(&it, &it_end)) {
-            const char *field_name = json_object_iter_peek_name(&it);
-            struct json_object *field_value = json_object_iter_peek_value(&it);
-
-            char field_path[BUFFER_SIZE] = "";
-            build_jsonb_path(field_name, field_path);
-
-            char single_set_clause[BUFFER_SIZE];
-            snprintf(single_set_clause, sizeof(single_set_clause),
-                     "jsonb_set(data, '{%s}', '%s'::jsonb, true)",
-                     field_path, json_object_to_json_string_ext(field_value, JSON_C_TO_STRING_PLAIN));
-
-            strcat(jsonb_set_clause, single_set_clause);
-            strcat(jsonb_set_clause, ", ");
+/* types an index may be limited to with the pgType option and the jsonb type of their values, others are refused */
+static const char *const index_pg_types[][2] = {{"text",             "string"},
+                                                {"numeric",          "number"},
+                                                {"bigint",           "number"},
+                                                {"double precision", "number"},
+                                                {"boolean",          "boolean"}};
 
-            json_object_iter_next(&it);
+/**
+ * builds CREATE INDEX statement of the spec: GIN with jsonb_path_ops for the wildcard key {"$**": 1},
+ * which serves containment and equality jsonpath conditions over the whole document.
+ * keys of fields become btree over the jsonb values of the fields with the NULL order of sort keys of find,
+ * so the index serves range conditions and the order of a sorted find and keeps unique constraints.
+ * pgType makes the btree partial to values of that type in the first field, WHERE jsonb_typeof(...) = 'number',
+ * range conditions check the same type with a literal, so the planner proves the typed index covers them.
+ * hashed keys are refused, no condition compares a single field a hash index could serve.
+ * return false with errmsg if the spec cannot be mapped to PostgreSQL
+ */
+static bool index_create_statement(const char *table_name, const bson_t *key, const char *name, const bson_t *spec,
+                                   char *query, size_t size, char *errmsg, size_t errmsg_size) {
+    bson_iter_t iter;
+    const char *json_type = NULL;
+    const char *method = NULL;
+    char columns[BUFFER_SIZE] = "";
+    char predicate[BUFFER_SIZE] = "";
+    char index_name[NAMEDATALEN * 2];
+    int n_fields = 0;
+
+    if (bson_iter_init_find(&iter, spec, "pgType")) {
+        const char *pg_type = BSON_ITER_HOLDS_UTF8(&iter) ? bson_iter_utf8(&iter, NULL) : "";
+        for (int i = 0; i < (int) (sizeof(index_pg_types) / sizeof(index_pg_types[0])); i++) {
+            if (strcmp(index_pg_types[i][0], pg_type) == 0) {
+                json_type = index_pg_types[i][1];
+            }
         }
-
-        /* Remove last ", " */
-        if (strlen(jsonb_set_clause) > 0) {
-            jsonb_set_clause[strlen(jsonb_set_clause) - 2] = '\0';
+        if (json_type == NULL) {
+            snprintf(errmsg, errmsg_size, "pgType %s of index %s is not supported", pg_type, name);
+            return false;
         }
+    }
 
-        /* Build condition using JSON path */
-        char jsonpath_condition[BUFFER_SIZE * 10] = "";
-        build_jsonb_path_condition(q_json, jsonpath_condition);
+    if (!bson_iter_init(&iter, key)) {
+        snprintf(errmsg, errmsg_size, "invalid key of index %s", name);
+        return false;
+    }
+    while (bson_iter_next(&iter)) {
+        const char *field = bson_iter_key(&iter);
 
-        char query[BUFFER_SIZE * 20];
-        if (json_object_object_get_ex(update_json, "multi", &multi_json) && json_object_get_boolean(multi_json)) {
-            snprintf(query, sizeof(query),
-                     "UPDATE %s SET data = %s WHERE jsonb_path_exists(data, '%s')",
-                     table_name, jsonb_set_clause, jsonpath_condition);
-        } else {
-            snprintf(query, sizeof(query),
-                     "UPDATE %s SET data = %s WHERE ctid IN (SELECT ctid FROM %s WHERE jsonb_path_exists(data, '%s') LIMIT 1)",
-                     table_name, jsonb_set_clause, table_name, jsonpath_condition);
+        if (n_fields++ > 0) {
+            strncat(columns, ", ", sizeof(columns) - strlen(columns) - 1);
         }
-
-        PGresult *res = PQexec(conn, query);
-        if (PQresultStatus(res) != PGRES_COMMAND_OK) {
-            fprintf(stderr, "UPDATE command failed: %s\n", PQerrorMessage(conn));
-            PQclear(res);
+        if (strcmp(field, "$**") == 0) {
+            method = " USING gin";
+            strncat(columns, "data jsonb_path_ops", sizeof(columns) - strlen(columns) - 1);
+        } else if (BSON_ITER_HOLDS_NUMBER(&iter) && bson_iter_as_int64(&iter) != 0) {
+            char expr[BUFFER_SIZE];
+            jsonb_path_expression(expr, sizeof(expr), field);
+            strncat(columns, expr, sizeof(columns) - strlen(columns) - 1);
+            strncat(columns, bson_iter_as_int64(&iter) < 0 ? " DESC NULLS LAST" : " NULLS FIRST",
+                    sizeof(columns) - strlen(columns) - 1);
+            if (json_type != NULL && n_fields == 1) {
+                snprintf(predicate, sizeof(predicate), " WHERE jsonb_typeof%s = ", expr);
+                sql_append_quoted(predicate, sizeof(predicate), json_type, '\'');
+            }
+        } else {
+            snprintf(errmsg, errmsg_size, "index type of field %s of index %s is not supported", field, name);
             return false;
         }
-        *updated_count += atoi(PQcmdTuples(res));
-        PQclear(res);
     }
+    /* the wildcard key is all of the document already */
+    if (n_fields == 0 || (method != NULL && n_fields > 1)) {
+        snprintf(errmsg, errmsg_size, "key of index %s must have one field for its index type", name);
+        return false;
+    }
+    if (json_type != NULL && predicate[0] == '\0') {
+        snprintf(errmsg, errmsg_size, "pgType of index %s needs a btree key of a field first", name);
+        return false;
+    }
+
+    snprintf(index_name, sizeof(index_name), "%s_%s", table_name, name);
+    snprintf(query, size, "CREATE %sINDEX CONCURRENTLY IF NOT EXISTS ",
+             bson_iter_init_find(&iter, spec, "unique") && bson_iter_as_bool(&iter) ? "UNIQUE " : "");
+    sql_append_quoted(query, size, index_name, '"');
+    snprintf(query + strlen(query), size - strlen(query), " ON %s%s (%s)%s", table_name,
+             method != NULL ? method : "", columns, predicate);
     return true;
 }
 
-/* Connects to database, checks and creates required table if it doesn't exist,
-   and executes update queries for given data array.
-   Returns true if operation was successful, false otherwise. */
-bool execute_query_update_to_postgres(const char *json_metadata, const char *json_data_array, int *updated_count) {
-    PGconn *conn = PQconnectdb(PG_CONNINFO);
-    if (PQstatus(conn) != CONNECTION_OK) {
-        fprintf(stderr, "Connection to database failed: %s", PQerrorMessage(conn));
-        PQfinish(conn);
-        return false;
+/* Stores spec of the index as comment of the PostgreSQL index it was created as, listIndexes returns it.
+   Version field of the spec is always 2, the namespace is not kept. */
+static bool index_store_spec(PGconn *conn, const char *table_name, const char *name, const bson_t *spec) {
+    bson_t stored;
+    bson_iter_t iter;
+    char index_name[NAMEDATALEN * 2];
+
+    bson_init(&stored);
+    bson_append_int32(&stored, "v", 1, 2);
+    if (bson_iter_init(&iter, spec)) {
+        while (bson_iter_next(&iter)) {
+            const char *field = bson_iter_key(&iter);
+            if (strcmp(field, "v") != 0 && strcmp(field, "ns") != 0 && strcmp(field, "name") != 0) {
+                bson_append_iter(&stored, field, -1, &iter);
+            }
+        }
     }
-
-    /* Parse metadata JSON */
-    struct json_object *metadata_json = json_tokener_parse(json_metadata);
-    if (!metadata_json) {
-        fprintf(stderr, "Failed to parse metadata JSON\n");
-        PQfinish(conn);
-        return false;
+    bson_append_utf8(&stored, "name", 4, name, -1);
+    char *json = bson_as_relaxed_extended_json(&stored, NULL);
+    bson_destroy(&stored);
+
+    size_t size = 2 * strlen(json) + 2 * sizeof(index_name) + 64;
+    char *query = (char *) malloc(size);
+    snprintf(index_name, sizeof(index_name), "%s_%s", table_name, name);
+    strcpy(query, "COMMENT ON INDEX ");
+    sql_append_quoted(query, size, index_name, '"');
+    strcat(query, " IS ");
+    sql_append_quoted(query, size, json, '\'');
+    bson_free(json);
+
+    PGresult *res = proxy_exec(conn, query);
+    bool ok = PQresultStatus(res) == PGRES_COMMAND_OK;
+    if (!ok) {
+        fprintf(stderr, "Failed to store spec of index %s: %s", index_name, PQresultErrorMessage(res));
     }
+    PQclear(res);
+    free(query);
+    return ok;
+}
 
-    struct json_object *update_obj, *db_obj;
-    if (!json_object_object_get_ex(metadata_json, "update", &update_obj) ||
-        !json_object_object_get_ex(metadata_json, "$db", &db_obj)) {
-        fprintf(stderr, "Invalid metadata JSON format\n");
-        json_object_put(metadata_json);
-        PQfinish(conn);
-        return false;
+/* Prepares conn for concurrent index builds and drops, they wait for every transaction older than them.
+   The waits are bounded by INDEX_LOCK_TIMEOUT, so the command fails with an error instead of hanging behind
+   a long transaction or an open cursor. index_ddl_end resets the timeout before the connection is released. */
+static void index_ddl_begin(PGconn *conn) {
+    PQclear(proxy_exec(conn, "SET lock_timeout = '" INDEX_LOCK_TIMEOUT "'"));
+}
+
+static void index_ddl_end(PGconn *conn) {
+    PQclear(proxy_exec(conn, "RESET lock_timeout"));
+}
+
+/* Drops PostgreSQL index index_name, a failed concurrent build leaves an invalid one behind. */
+static bool index_drop(PGconn *conn, const char *index_name) {
+    char query[NAMEDATALEN * 4];
+
+    snprintf(query, sizeof(query), "DROP INDEX CONCURRENTLY IF EXISTS ");
+    sql_append_quoted(query, sizeof(query), index_name, '"');
+    PGresult *res = proxy_exec(conn, query);
+    bool ok = PQresultStatus(res) == PGRES_COMMAND_OK;
+    if (!ok) {
+        fprintf(stderr, "Failed to drop index %s: %s", index_name, PQresultErrorMessage(res));
     }
+    PQclear(res);
+    return ok;
+}
 
-    const char *collection = json_object_get_string(update_obj);
-    const char *dbname = json_object_get_string(db_obj);
+/* return true if key patterns have the same fields in the same order with the same directions */
+static bool index_key_equal(const bson_t *a, const bson_t *b) {
+    bson_iter_t ia, ib;
 
-    /* Check and create database if it does not exist */
-    if (!check_and_create_database(conn, dbname)) {
-        fprintf(stderr, "Failed to create or check database\n");
-        json_object_put(metadata_json);
-        PQfinish(conn);
+    if (!bson_iter_init(&ia, a) || !bson_iter_init(&ib, b)) {
         return false;
     }
+    while (bson_iter_next(&ia)) {
+        if (!bson_iter_next(&ib) || strcmp(bson_iter_key(&ia), bson_iter_key(&ib)) != 0) {
+            return false;
+        }
+        if (BSON_ITER_HOLDS_UTF8(&ia) || BSON_ITER_HOLDS_UTF8(&ib)) {
+            if (!BSON_ITER_HOLDS_UTF8(&ia) || !BSON_ITER_HOLDS_UTF8(&ib) ||
+                strcmp(bson_iter_utf8(&ia, NULL), bson_iter_utf8(&ib, NULL)) != 0) {
+                return false;
+            }
+        } else if (bson_iter_as_int64(&ia) != bson_iter_as_int64(&ib)) {
+            return false;
+        }
+    }
+    return !bson_iter_next(&ib);
+}
 
-    PQfinish(conn);
+/* Looks for index name among specs of index_specs.
+   Return 1 if it exists with key, -1 if it exists with another key, 0 if there is no such index. */
+static int index_spec_find(const PGresult *specs, const char *name, const bson_t *key) {
+    int found = 0;
 
-    char conninfo[BUFFER_SIZE];
-    snprintf(conninfo, sizeof(conninfo), "dbname=%s user=user1 password=passwd port=5433", dbname);
-    conn = PQconnectdb(conninfo);
-    if (PQstatus(conn) != CONNECTION_OK) {
-        fprintf(stderr, "Connection to database %s failed: %s", dbname, PQerrorMessage(conn));
-        json_object_put(metadata_json);
-        PQfinish(conn);
-        return false;
+    for (int i = 0; found == 0 && i < PQntuples(specs); i++) {
+        bson_t spec, spec_key;
+        bson_iter_t iter;
+        bson_error_t error;
+
+        if (!bson_init_from_json(&spec, PQgetvalue(specs, i, 0), -1, &error)) {
+            continue;
+        }
+        if (bson_iter_init_find(&iter, &spec, "name") && BSON_ITER_HOLDS_UTF8(&iter) &&
+            strcmp(bson_iter_utf8(&iter, NULL), name) == 0) {
+            found = bson_find_document(&spec, "key", &spec_key) && index_key_equal(&spec_key, key) ? 1 : -1;
+        }
+        bson_destroy(&spec);
     }
+    return found;
+}
 
-    /* Check and create table if it does not exist */
-    if (!check_and_create_table(conn, collection)) {
-        fprintf(stderr, "Failed to create or check table\n");
-        json_object_put(metadata_json);
-        PQfinish(conn);
+/**
+ * serves createIndexes: every index of the command becomes an expression index of the table,
+ * built concurrently over a libpq connection, also with SPI backend, so writes to the collection go on.
+ * return false with an error in the reply if an index could not be created
+ */
+bool execute_query_create_indexes(const mongo_msg_t *msg, find_reply_t *reply) {
+    const char *collection, *dbname;
+    bson_iter_t iter, indexes;
+    char errmsg[512];
+    bool ok = true;
+
+    if (!command_target(msg, "createIndexes", &collection, &dbname) ||
+        !bson_iter_init_find(&iter, msg->docs[0], "indexes") || !BSON_ITER_HOLDS_ARRAY(&iter) ||
+        !bson_iter_recurse(&iter, &indexes)) {
+        find_reply_error(reply, 9, "FailedToParse", "createIndexes needs a collection and an array of indexes");
         return false;
     }
 
-    /* Parse update JSON array */
-    struct json_object *update_array = json_tokener_parse(json_data_array);
-    if (!update_array || json_object_get_type(update_array) != json_type_array) {
-        fprintf(stderr, "Failed to parse update JSON array\n");
-        json_object_put(metadata_json);
-        PQfinish(conn);
+    pooled_conn_t *pc = pool_acquire_libpq(dbname);
+    if (pc == NULL) {
+        find_reply_error(reply, 1, "InternalError", "no connection to the database");
         return false;
     }
-
-    /* Execute update queries */
-    if (!execute_update_queries(conn, collection, update_array, updated_count)) {
-        fprintf(stderr, "Failed to execute update queries\n");
-        json_object_put(metadata_json);
-        json_object_put(update_array);
-        PQfinish(conn);
+    PGconn *conn = pc->conn;
+
+    /* a missing table has no specs, not even the one of _id_ */
+    PGresult *before = index_specs(conn, collection);
+    bool created = before != NULL && PQntuples(before) == 0;
+    if (before == NULL || !check_and_create_table(conn, collection)) {
+        find_reply_error(reply, 1, "InternalError", "failed to read indexes of the collection");
+        PQclear(before);
+        pool_release(pc);
         return false;
     }
+    int n_before = created ? 1 : PQntuples(before);
+    index_ddl_begin(conn);
 
-    /* Clean up */
-    json_object_put(metadata_json);
-    json_object_put(update_array);
-    PQfinish(conn);
+    while (ok && bson_iter_next(&indexes)) {
+        bson_t spec, key;
+        char name[NAMEDATALEN];
+        char query[BUFFER_SIZE];
+        uint32_t len;
+        const uint8_t *data;
 
-    return true;
-}
+        if (!BSON_ITER_HOLDS_DOCUMENT(&indexes)) {
+            continue;
+        }
+        bson_iter_document(&indexes, &len, &data);
+        bson_init_static(&spec, data, len);
+        if (!bson_find_document(&spec, "key", &key)) {
+            find_reply_error(reply, 9, "FailedToParse", "index spec has no key");
+            ok = false;
+            break;
+        }
+        if (bson_iter_init_find(&iter, &spec, "name") && BSON_ITER_HOLDS_UTF8(&iter)) {
+            snprintf(name, sizeof(name), "%s", bson_iter_utf8(&iter, NULL));
+        } else {
+            index_default_name(&key, name, sizeof(name));
+        }
 
-/* Executes find query on specified table with given filter conditions.
-   Stores results in results parameter. */
-bool
-execute_find_query(PGconn *conn, const char *table_name, struct json_object *find_json, struct json_object **results) {
-    struct json_object *filter_json, *limit_json;
-    char condition[BUFFER_SIZE] = "";
-    int limit = -1;
-    bool has_nested_field = false;
-
-    /* Parse filter conditions from JSON */
-    if (json_object_object_get_ex(find_json, "filter", &filter_json)) {
-        struct json_object_iterator it = json_object_iter_begin(filter_json);
-        struct json_object_iterator it_end = json_object_iter_end(filter_json);
-
-        /* Check if there are any nested fields */
-        while (!json_object_iter_equal(&it, &it_end)) {
-            const char *field_name = json_object_iter_peek_name(&it);
-            if (strchr(field_name, '.')) {
-                has_nested_field = true;
-                break;
-            }
-            json_object_iter_next(&it);
-        }
-
-        it = json_object_iter_begin(filter_json);
-        if (!has_nested_field) {
-            /* Simple fields logic */
-            while (!json_object_iter_equal(&it, &it_end)) {
-                const char *field_name = json_object_iter_peek_name(&it);
-                struct json_object *field_value = json_object_iter_peek_value(&it);
-                const char *value_str = json_object_get_string(field_value);
-
-                strcat(condition, "data->>");
-                strcat(condition, "'");
-                strcat(condition, field_name);
-                strcat(condition, "'");
-                strcat(condition, " = '");
-                strcat(condition, value_str);
-                strcat(condition, "' AND ");
-
-                json_object_iter_next(&it);
-            }
+        /* an index of the same name is kept if its key is the same, as mongod does */
+        int existing = index_spec_find(before, name, &key);
+        if (existing > 0) {
+            continue;
+        }
+        if (existing < 0) {
+            snprintf(errmsg, sizeof(errmsg), "an index named %s with a different key already exists", name);
+            find_reply_error(reply, 86, "IndexKeySpecsConflict", errmsg);
+            ok = false;
+            break;
+        }
 
-            /* Remove last " AND " */
-            if (strlen(condition) > 0) {
-                condition[strlen(condition) - 5] = '\0';
-            }
-        } else {
-            /* Nested fields logic */
-            while (!json_object_iter_equal(&it, &it_end)) {
-                const char *field_name = json_object_iter_peek_name(&it);
-                struct json_object *field_value = json_object_iter_peek_value(&it);
-                const char *value_str = json_object_to_json_string_ext(field_value, JSON_C_TO_STRING_PLAIN);
-
-                char nested_condition[BUFFER_SIZE];
-                snprintf(nested_condition, sizeof(nested_condition),
-                         "jsonb_path_exists(data, '$.%s ? (@ == %s)'::jsonpath)",
-                         field_name, value_str);
-                strcat(condition, nested_condition);
-                strcat(condition, " AND ");
-
-                json_object_iter_next(&it);
-            }
+        if (!index_create_statement(collection, &key, name, &spec, query, sizeof(query), errmsg, sizeof(errmsg))) {
+            find_reply_error(reply, 67, "CannotCreateIndex", errmsg);
+            ok = false;
+            break;
+        }
 
-            /* Remove last " AND " */
-            if (strlen(condition) > 0) {
-                condition[strlen(condition) - 5] = '\0';
+        PGresult *res = proxy_exec(conn, query);
+        if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+            const char *sqlstate = proxy_result_sqlstate(conn, res);
+            char index_name[NAMEDATALEN * 2];
+
+            snprintf(errmsg, sizeof(errmsg), "index %s: %s", name, PQresultErrorMessage(res));
+            if (sqlstate != NULL && strcmp(sqlstate, "55P03") == 0) {
+                /* a transaction older than the build ran longer than INDEX_LOCK_TIMEOUT */
+                snprintf(errmsg, sizeof(errmsg), "index %s: the build waited %s for older transactions on the "
+                         "database, retry once they end", name, INDEX_LOCK_TIMEOUT);
+                find_reply_error(reply, 67, "CannotCreateIndex", errmsg);
+            } else if (sqlstate != NULL && strcmp(sqlstate, "23505") == 0) {
+                find_reply_error(reply, 11000, "DuplicateKey", errmsg);
+            } else {
+                find_reply_error(reply, 67, "CannotCreateIndex", errmsg);
             }
+            snprintf(index_name, sizeof(index_name), "%s_%s", collection, name);
+            index_drop(conn, index_name);
+            ok = false;
+        } else if (!index_store_spec(conn, collection, name, &spec)) {
+            find_reply_error(reply, 67, "CannotCreateIndex", "failed to store spec of the index");
+            ok = false;
         }
+        PQclear(res);
     }
 
-    /* Parse limit from the JSON */
-    if (json_object_object_get_ex(find_json, "limit", &limit_json)) {
-        limit = json_object_get_int(limit_json);
+    PGresult *after = ok ? index_specs(conn, collection) : NULL;
+    if (ok && after == NULL) {
+        find_reply_error(reply, 1, "InternalError", "failed to read indexes of the collection");
+        ok = false;
     }
-
-    /* Construct SQL query */
-    char query[BUFFER_SIZE];
-    if (strlen(condition) > 0) {
-        if (limit > 0) {
-            snprintf(query, sizeof(query), "SELECT data FROM %s WHERE %s LIMIT %d", table_name, condition, limit);
-        } else {
-            snprintf(query, sizeof(query), "SELECT data FROM %s WHERE %s", table_name, condition);
-        }
-    } else {
-        if (limit > 0) {
-            snprintf(query, sizeof(query), "SELECT data FROM %s LIMIT %d", table_name, limit);
-        } else {
-            snprintf(query, sizeof(query), "SELECT data FROM %s", table_name);
+    if (ok) {
+        bson_append_int32(&reply->body, "numIndexesBefore", -1, n_before);
+        bson_append_int32(&reply->body, "numIndexesAfter", -1, PQntuples(after));
+        bson_append_bool(&reply->body, "createdCollectionAutomatically", -1, created);
+        if (PQntuples(after) == n_before) {
+            bson_append_utf8(&reply->body, "note", -1, "all indexes already exist", -1);
         }
+        bson_append_double(&reply->body, "ok", -1, 1.0);
     }
+    PQclear(before);
+    PQclear(after);
+    index_ddl_end(conn);
+    pool_release(pc);
+    return ok;
+}
 
-    PGresult *res = PQexec(conn, query);
-    if (PQresultStatus(res) != PGRES_TUPLES_OK) {
-        fprintf(stderr, "SELECT command failed: %s", PQerrorMessage(conn));
-        PQclear(res);
+/* Serves listIndexes: specs of the indexes of the collection are returned as one batch of a cursor.
+   Return false with an error in the reply if the collection does not exist. */
+bool execute_query_list_indexes(const mongo_msg_t *msg, find_reply_t *reply, char **collection, char **dbname) {
+    const char *list_collection, *list_dbname;
+
+    if (!command_target(msg, "listIndexes", &list_collection, &list_dbname)) {
+        find_reply_error(reply, 9, "FailedToParse", "listIndexes needs a collection");
         return false;
     }
+    strcpy(*collection, list_collection);
+    strcpy(*dbname, list_dbname);
 
-    /* Process query results */
-    int rows = PQntuples(res);
-    *results = json_object_new_array();
-
-    for (int i = 0; i < rows; i++) {
-        const char *field_value = PQgetvalue(res, i, 0);
+    pooled_conn_t *pc = pool_acquire(*dbname);
+    if (pc == NULL) {
+        find_reply_error(reply, 1, "InternalError", "no connection to the database");
+        return false;
+    }
+    PGresult *res = index_specs(pc->conn, *collection);
+    pool_release(pc);
 
-        struct json_object *json_value = json_tokener_parse(field_value);
-        json_object_array_add(*results, json_value);
+    if (res == NULL || PQntuples(res) == 0) {
+        char errmsg[512];
+        snprintf(errmsg, sizeof(errmsg), "ns does not exist: %s.%s", *dbname, *collection);
+        find_reply_error(reply, 26, "NamespaceNotFound", errmsg);
+        PQclear(res);
+        return false;
     }
 
+    find_reply_begin(reply, "firstBatch");
+    for (int i = 0; i < PQntuples(res); i++) {
+        find_reply_add_row(reply, res, i);
+    }
     PQclear(res);
     return true;
 }
 
-/* Connects to database, checks and creates required table if it doesn't exist,
-   and executes find query for given metadata.
-   Stores results and returns true if operation was successful, false otherwise. */
-bool execute_query_find_to_postgres(const char *json_metadata, struct json_object **results, char **collection,
-                                    char **dbname) {
-    PGconn *conn = PQconnectdb(PG_CONNINFO);
-    if (PQstatus(conn) != CONNECTION_OK) {
-        fprintf(stderr, "Connection to database failed: %s", PQerrorMessage(conn));
-        PQfinish(conn);
-        return false;
+/* return true if the index of spec is named by the index field of dropIndexes: "*", its name,
+   one of names of an array or its key pattern */
+static bool index_matches(const bson_iter_t *target, const bson_t *spec) {
+    bson_iter_t iter, names;
+    bson_t key, target_key;
+    const char *name = bson_iter_init_find(&iter, spec, "name") && BSON_ITER_HOLDS_UTF8(&iter)
+                       ? bson_iter_utf8(&iter, NULL) : "";
+
+    if (BSON_ITER_HOLDS_UTF8(target)) {
+        const char *target_name = bson_iter_utf8(target, NULL);
+        return strcmp(target_name, "*") == 0 || strcmp(target_name, name) == 0;
     }
-
-    struct json_object *metadata_json = json_tokener_parse(json_metadata);
-    if (!metadata_json) {
-        fprintf(stderr, "Failed to parse metadata JSON\n");
-        PQfinish(conn);
+    if (BSON_ITER_HOLDS_ARRAY(target) && bson_iter_recurse(target, &names)) {
+        while (bson_iter_next(&names)) {
+            if (BSON_ITER_HOLDS_UTF8(&names) && strcmp(bson_iter_utf8(&names, NULL), name) == 0) {
+                return true;
+            }
+        }
         return false;
     }
-
-    struct json_object *find_obj, *db_obj;
-    if (!json_object_object_get_ex(metadata_json, "find", &find_obj) ||
-        !json_object_object_get_ex(metadata_json, "$db", &db_obj)) {
-        fprintf(stderr, "Invalid metadata JSON format\n");
-        json_object_put(metadata_json);
-        PQfinish(conn);
-        return false;
+    if (BSON_ITER_HOLDS_DOCUMENT(target) && bson_find_document(spec, "key", &key)) {
+        uint32_t len;
+        const uint8_t *data;
+        bson_iter_document(target, &len, &data);
+        bson_init_static(&target_key, data, len);
+        return index_key_equal(&key, &target_key);
     }
+    return false;
+}
 
-
-    strcpy(*collection, json_object_get_string(find_obj));
-    strcpy(*dbname, json_object_get_string(db_obj));
-    elog(WARNING, "EXECUTE_QUERY_FIND_TO_POSTGRES: line: %d dbname: %s collection: %s", __LINE__, *dbname, *collection);
-
-    if (!check_and_create_database(conn, *dbname)) {
-        fprintf(stderr, "Failed to create or check database\n");
-        json_object_put(metadata_json);
-        PQfinish(conn);
+/**
+ * serves dropIndexes: drops indexes named by the command, "*" drops all of them except _id_,
+ * which is the primary key of the table and cannot be dropped.
+ * return false with an error in the reply if a named index does not exist
+ */
+bool execute_query_drop_indexes(const mongo_msg_t *msg, find_reply_t *reply) {
+    const char *collection, *dbname;
+    bson_iter_t target;
+    char errmsg[512];
+    bool ok = true;
+    int n_dropped = 0;
+
+    if (!command_target(msg, "dropIndexes", &collection, &dbname) ||
+        !bson_iter_init_find(&target, msg->docs[0], "index")) {
+        find_reply_error(reply, 9, "FailedToParse", "dropIndexes needs a collection and an index");
         return false;
     }
-
-    PQfinish(conn);
-
-    char conninfo[BUFFER_SIZE];
-    snprintf(conninfo, sizeof(conninfo), "dbname=%s user=user1 password=passwd port=5433", *dbname);
-    conn = PQconnectdb(conninfo);
-    if (PQstatus(conn) != CONNECTION_OK) {
-        fprintf(stderr, "Connection to database %s failed: %s", *dbname, PQerrorMessage(conn));
-        json_object_put(metadata_json);
-        PQfinish(conn);
+    if (BSON_ITER_HOLDS_UTF8(&target) && strcmp(bson_iter_utf8(&target, NULL), "_id_") == 0) {
+        find_reply_error(reply, 72, "InvalidOptions", "cannot drop _id index");
         return false;
     }
 
-    if (!check_and_create_table(conn, *collection)) {
-        fprintf(stderr, "Failed to create or check table\n");
-        json_object_put(metadata_json);
-        PQfinish(conn);
+    pooled_conn_t *pc = pool_acquire_libpq(dbname);
+    if (pc == NULL) {
+        find_reply_error(reply, 1, "InternalError", "no connection to the database");
         return false;
     }
-
-    struct json_object *find_json = json_tokener_parse(json_metadata);
-    if (!find_json) {
-        fprintf(stderr, "Failed to parse find JSON\n");
-        json_object_put(metadata_json);
-        PQfinish(conn);
+    PGresult *res = index_specs(pc->conn, collection);
+    if (res == NULL || PQntuples(res) == 0) {
+        snprintf(errmsg, sizeof(errmsg), "ns not found %s.%s", dbname, collection);
+        find_reply_error(reply, 26, "NamespaceNotFound", errmsg);
+        PQclear(res);
+        pool_release(pc);
         return false;
     }
 
-    if (!execute_find_query(conn, *collection, find_json, results)) {
-        fprintf(stderr, "Failed to execute find query\n");
-        json_object_put(metadata_json);
-        json_object_put(find_json);
-        PQfinish(conn);
-        return false;
-    }
+    /* the first row is _id_, which has no index of its own to drop */
+    index_ddl_begin(pc->conn);
+    for (int i = 1; ok && i < PQntuples(res); i++) {
+        bson_t spec;
+        bson_error_t error;
 
-    json_object_put(metadata_json);
-    json_object_put(find_json);
-    PQfinish(conn);
+        if (!bson_init_from_json(&spec, PQgetvalue(res, i, 0), -1, &error)) {
+            elog(WARNING, "pg_proxy: spec of index %s is not JSON: %s", PQgetvalue(res, i, 1), error.message);
+            continue;
+        }
+        if (index_matches(&target, &spec)) {
+            ok = index_drop(pc->conn, PQgetvalue(res, i, 1));
+            n_dropped++;
+        }
+        bson_destroy(&spec);
+    }
 
-    return true;
+    if (!ok) {
+        find_reply_error(reply, 1, "InternalError", "failed to drop index");
+    } else if (n_dropped == 0 && !(BSON_ITER_HOLDS_UTF8(&target) && strcmp(bson_iter_utf8(&target, NULL), "*") == 0)) {
+        snprintf(errmsg, sizeof(errmsg), "index not found in %s.%s", dbname, collection);
+        find_reply_error(reply, 27, "IndexNotFound", errmsg);
+        ok = false;
+    } else {
+        bson_append_int32(&reply->body, "nIndexesWas", -1, PQntuples(res));
+        bson_append_double(&reply->body, "ok", -1, 1.0);
+    }
+    PQclear(res);
+    index_ddl_end(pc->conn);
+    pool_release(pc);
+    return ok;
 }
 
 /* Processes incoming message and performs corresponding database operations
@@ -863,10 +4683,9 @@ bool execute_query_find_to_postgres(const char *json_metadata, struct json_objec
 void
 process_message(uint32_t response_to,
                 unsigned char *buffer,
-                char *json_metadata,
-                char *json_data_array,
+                const mongo_msg_t *msg,
                 int *flag,
-                struct json_object **results,
+                find_reply_t *find_reply,
                 char **dbname,
                 char **collection,
                 int *changed_count) {
@@ -874,14 +4693,12 @@ process_message(uint32_t response_to,
     if (buffer[18] == 1) {
         *flag = 1;
         elog(WARNING, "ignore");
-        memset(buffer, 0, BUFFER_SIZE);
         return;
     }
 
     if (buffer[26] == 'h') {
         *flag = 1;
         elog(WARNING, "ignore");
-        memset(buffer, 0, BUFFER_SIZE);
         return;
     }
 
@@ -889,7 +4706,6 @@ process_message(uint32_t response_to,
     if (buffer[26] == 'p') {
         *flag = 2;
         elog(WARNING, "ping");
-        memset(buffer, 0, BUFFER_SIZE);
         return;
     }
 
@@ -897,83 +4713,105 @@ process_message(uint32_t response_to,
     if (buffer[26] == 'e') {
         *flag = 5;
         elog(WARNING, "end session");
-        memset(buffer, 0, BUFFER_SIZE);
         return;
     }
     
+    if (strcmp((char *) buffer + 26, "createIndexes") == 0) {
+        if (!execute_query_create_indexes(msg, find_reply)) {
+            elog(DEBUG1, "pg_proxy: createIndexes failed: %s", find_reply_errmsg(find_reply));
+        }
+        *flag = 11;
+        return;
+    }
+
+    if (strcmp((char *) buffer + 26, "listIndexes") == 0) {
+        *flag = execute_query_list_indexes(msg, find_reply, collection, dbname) ? 10 : 11;
+        return;
+    }
+
+    /* dropIndexes is told apart from delete before the first letter of the command is looked at */
+    if (strcmp((char *) buffer + 26, "dropIndexes") == 0) {
+        if (!execute_query_drop_indexes(msg, find_reply)) {
+            elog(DEBUG1, "pg_proxy: dropIndexes failed: %s", find_reply_errmsg(find_reply));
+        }
+        *flag = 11;
+        return;
+    }
+
     if (buffer[26] == 'i') {
         int inserted_count = 0;
-        if (execute_query_insert_to_postgres(json_metadata, json_data_array, &inserted_count)) {
+        if (execute_query_insert_to_postgres(msg, &inserted_count)) {
             elog(WARNING, "Insert to PostgreSQL successful %d", inserted_count);
             *flag = 3;
-            memset(buffer, 0, BUFFER_SIZE);
             *changed_count = inserted_count;
             return;
         } else {
             elog(WARNING, "Insert to PostgreSQL failed");
             *flag = 4;
-            memset(buffer, 0, BUFFER_SIZE);
             return;
         }
     }
     
     if (buffer[26] == 'd') {
         int deleted_count = 0;
-        if (execute_query_delete_to_postgres(json_metadata, json_data_array, &deleted_count)) {
+        if (execute_query_delete_to_postgres(msg, &deleted_count)) {
             elog(WARNING, "Delete from PostgreSQL successful %d", deleted_count);
             *flag = 6;
-            memset(buffer, 0, BUFFER_SIZE);
             *changed_count = deleted_count;
             return;
         } else {
             elog(WARNING, "Delete from PostgreSQL failed");
             *flag = 7;
-            memset(buffer, 0, BUFFER_SIZE);
             return;
         }
     }
     
     if (buffer[26] == 'u') {
-        elog(WARNING, "че там лежит в запросе %s", json_data_array);
         int updated_count = 0;
-        if (execute_query_update_to_postgres(json_metadata, json_data_array, &updated_count)) {
+        if (execute_query_update_to_postgres(msg, &updated_count)) {
             elog(WARNING, "Update from PostgreSQL successful %d", updated_count);
             *flag = 8;
-            memset(buffer, 0, BUFFER_SIZE);
             *changed_count = updated_count;
             return;
         } else {
             elog(WARNING, "Update from PostgreSQL failed");
             *flag = 9;
-            memset(buffer, 0, BUFFER_SIZE);
             return;
         }
     }
     
     if (buffer[26] == 'f') {
-        //struct json_object *results;
-        if (execute_query_find_to_postgres(json_metadata, results, collection, dbname)) {
+        if (execute_query_find_to_postgres(msg, find_reply, collection, dbname)) {
             elog(WARNING, "PROCESS_MESSAGE: line: %d dbname: %s collection: %s", __LINE__, *dbname, *collection);
             *flag = 10;
-            fprintf(stderr, "Find query executed successfully. Results:\n%s\n",
-                    json_object_to_json_string_ext(*results, JSON_C_TO_STRING_PRETTY));
+            fprintf(stderr, "Find query executed successfully, %u documents\n", find_reply->n_docs);
         } else {
             fprintf(stderr, "Failed to execute find query\n");
+            /* Errors the driver can show, like unsupported operators, are sent as the reply */
+            if (bson_has_field(&find_reply->body, "errmsg")) {
+                *flag = 11;
+            }
         }
-        memset(buffer, 0, BUFFER_SIZE);
-        //json_object_put(results);
         return;
     }
-}
 
+    if (strcmp((char *) buffer + 26, "aggregate") == 0) {
+        *flag = execute_query_aggregate(msg, find_reply, collection, dbname) ? 10 : 11;
+        return;
+    }
+
+    if (strcmp((char *) buffer + 26, "getMore") == 0) {
+        *flag = execute_query_getmore(msg, find_reply, collection, dbname) ? 10 : 11;
+        return;
+    }
+
+    if (strcmp((char *) buffer + 26, "killCursors") == 0) {
+        execute_query_killcursors(msg, find_reply);
+        *flag = 11;
+        return;
+    }
+}
 
-typedef struct {
-    struct ev_io io;
-    int fd;
-    coro_context ctx;
-    coro_context main_ctx;
-    char stack[STACK_SIZE];
-} client_t;
 
 void coroutine_entry_point(void *arg) {
     client_t *client = (client_t *) arg;
@@ -983,13 +4821,28 @@ void coroutine_entry_point(void *arg) {
     ev_io_start(loop, &client->io);
 
     // Transfer control back to main context
-    coro_transfer(&client->ctx, &client->main_ctx);
+    client_yield(client);
 
-    // Start event loop to handle client events
-    ev_run(loop, 0);
+    for (;;) {
+        // no new messages are read while this one waits for PostgreSQL
+        ev_io_stop(loop, &client->io);
+        if (!client->closed) {
+            client_handle_read(loop, client);
+        }
+
+        if (client->closed) {
+            // client_resume frees the client, the coroutine is never resumed again
+            client_yield(client);
+        }
 
-    close(client->fd);
-    free(client);
+        // a client that does not read its replies is not read from either, write_cb resumes reading
+        if (client->out_queued > OUTPUT_HIGH_WATER) {
+            client->read_paused = true;
+        } else {
+            ev_io_start(loop, &client->io);
+        }
+        client_yield(client);
+    }
 }
 
 void accept_cb(struct ev_loop *loop, struct ev_io *watcher, int revents) {
@@ -1004,20 +4857,43 @@ void accept_cb(struct ev_loop *loop, struct ev_io *watcher, int revents) {
         return;
     }
 
+    // replies are written without blocking the worker, the rest waits in the output queue of the client
+    fcntl(client_sd, F_SETFL, fcntl(client_sd, F_GETFL, 0) | O_NONBLOCK);
+
     client_t *client = (client_t *) malloc(sizeof(client_t));
     client->fd = client_sd;
+    client->closed = false;
+    client->rbuf = NULL;
+    client->rbuf_len = 0;
+    client->rbuf_cap = 0;
+    ev_io_init(&client->write_io, write_cb, client_sd, EV_WRITE);
+    client->write_io.data = client;
+    client->out_head = NULL;
+    client->out_tail = NULL;
+    client->out_sent = 0;
+    client->out_queued = 0;
+    client->read_paused = false;
+    worker_accepted++;
+    worker_active++;
 
     // Initialize coroutine for client handling
     coro_create(&client->ctx, coroutine_entry_point, client, client->stack, STACK_SIZE);
-    coro_transfer(&client->main_ctx, &client->ctx);
+    client_resume(client);
 }
 
-int main_proxy(void) {
+static void worker_stats_cb(struct ev_loop *loop, struct ev_timer *watcher, int revents) {
+    elog(LOG, "pg_proxy worker %d: %llu connections accepted, %d active, %llu commands", worker_index,
+         (unsigned long long) worker_accepted, worker_active, (unsigned long long) worker_commands);
+}
+
+int main_proxy(Datum main_arg) {
     struct ev_loop *loop = ev_default_loop(0);
     int reuseaddr = 1;
     struct sockaddr_in addr;
     struct ev_io w_accept;
     int server_sd = -1;
+
+    worker_index = DatumGetInt32(main_arg);
     if ((server_sd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
         perror("socket error");
         return -1;
@@ -1029,6 +4905,13 @@ int main_proxy(void) {
         return -1;
     }
 
+    /* every worker binds MONGO_PORT, the kernel spreads new connections between them */
+    if (setsockopt(server_sd, SOL_SOCKET, SO_REUSEPORT, &reuseaddr, sizeof(reuseaddr)) < 0) {
+        perror("setsockopt error");
+        close(server_sd);
+        return -1;
+    }
+
     memset(&addr, 0, sizeof(addr));
     addr.sin_family = AF_INET;
     addr.sin_port = htons(MONGO_PORT);
@@ -1046,6 +4929,19 @@ int main_proxy(void) {
         return -1;
     }
 
+    if (proxy_backend == PROXY_BACKEND_SPI) {
+        BackgroundWorkerInitializeConnection(proxy_database, NULL, 0);
+        elog(LOG, "pg_proxy: commands to database %s are executed with SPI", proxy_database);
+    }
+
+    /* the coroutine runs until it first waits for the server, the loop resumes it afterwards */
+    maintenance_client = (client_t *) calloc(1, sizeof(client_t));
+    maintenance_client->fd = -1;
+    coro_create(&maintenance_client->ctx, pool_maintenance_entry_point, NULL, maintenance_client->stack, STACK_SIZE);
+    client_resume(maintenance_client);
+    ev_timer_init(&worker_stats_timer, worker_stats_cb, PROXY_STATS_INTERVAL, PROXY_STATS_INTERVAL);
+    ev_timer_start(loop, &worker_stats_timer);
+
     ev_io_init(&w_accept, accept_cb, server_sd, EV_READ);
     ev_io_start(loop, &w_accept);
 
@@ -1059,17 +4955,96 @@ void cleanup_and_exit(struct ev_loop *loop, int server_sd) {
     if (server_sd >= 0) {
         close(server_sd);
     }
+    pool_close_all();
     ev_loop_destroy(loop);
     exit(0);
 }
 
-void read_cb(struct ev_loop *loop, struct ev_io *watcher, int revents) {
-    unsigned char buffer[BUFFER_SIZE];
+/**
+ * reads what the client sent and answers every complete message in it
+ * a message may take several reads and one read may bring several pipelined messages,
+ * the bytes of an incomplete one wait in rbuf for the next read
+ * runs on the client coroutine, so queries to PostgreSQL suspend only this client
+ */
+static void client_handle_read(struct ev_loop *loop, client_t *client) {
+    size_t wanted = client->rbuf_len + READ_CHUNK_SIZE;
+    size_t offset = 0;
     ssize_t read;
 
-    char **query_string;
-    char **parameter_string;
-    u_int32_t msg_length = 0;
+    /* a message whose header already arrived is read into a buffer large enough for all of it */
+    if (client->rbuf_len >= 4) {
+        u_int32_t msg_length = ((u_int32_t *) client->rbuf)[0];
+        if (msg_length <= MAX_MESSAGE_SIZE && msg_length > wanted) {
+            wanted = msg_length;
+        }
+    }
+    if (wanted > client->rbuf_cap) {
+        size_t cap = client->rbuf_cap == 0 ? READ_CHUNK_SIZE : client->rbuf_cap;
+        while (cap < wanted) {
+            cap *= 2;
+        }
+        unsigned char *rbuf = (unsigned char *) realloc(client->rbuf, cap);
+        if (rbuf == NULL) {
+            fprintf(stderr, "Out of memory for a message of the client\n");
+            elog(WARNING, "pg_proxy: no memory to read a message, the client is disconnected");
+            client->closed = true;
+            return;
+        }
+        client->rbuf = rbuf;
+        client->rbuf_cap = cap;
+    }
+
+    read = recv(client->fd, client->rbuf + client->rbuf_len, client->rbuf_cap - client->rbuf_len, 0);
+
+    if (read < 0) {
+        if (errno == EINTR || errno == EAGAIN) {
+            return;
+        }
+        perror("read error");
+        client->closed = true;
+        return;
+    }
+
+    if (read == 0) {
+        client->closed = true;
+        return;
+    }
+
+    client->rbuf_len += read;
+    while (!client->closed && client->rbuf_len - offset >= MSG_HEADER_LEN) {
+        u_int32_t msg_length = ((u_int32_t *) (client->rbuf + offset))[0];
+
+        if (msg_length < MSG_HEADER_LEN || msg_length > MAX_MESSAGE_SIZE) {
+            fprintf(stderr, "Invalid message length %u\n", msg_length);
+            elog(WARNING, "pg_proxy: message of %u bytes, the client is disconnected", msg_length);
+            client->closed = true;
+            break;
+        }
+        if (client->rbuf_len - offset < msg_length) {
+            break;
+        }
+
+        client_handle_message(client, client->rbuf + offset, msg_length);
+        offset += msg_length;
+    }
+
+    if (offset > 0) {
+        memmove(client->rbuf, client->rbuf + offset, client->rbuf_len - offset);
+        client->rbuf_len -= offset;
+    }
+
+    /* an idle client does not keep the buffer of a large message */
+    if (client->rbuf_len == 0 && client->rbuf_cap > READ_BUFFER_KEEP_SIZE) {
+        free(client->rbuf);
+        client->rbuf = NULL;
+        client->rbuf_cap = 0;
+    }
+}
+
+/**
+ * answers one complete message, buffer holds its msg_length bytes
+ */
+static void client_handle_message(client_t *client, unsigned char *buffer, u_int32_t msg_length) {
     u_int32_t request_id = 0;
     u_int32_t response_to = 0;
     u_int32_t op_code = 0;
@@ -1087,26 +5062,7 @@ void read_cb(struct ev_loop *loop, struct ev_io *watcher, int revents) {
 
     unsigned char response[] = "I\001\000\000~\001\000\000\003\000\000\000\001\000\000\000\b\000\000\000\000\000\000\000\000\000\000\000\000\000\000\000\001\000\000\000%\001\000\000\bhelloOk\000\001\bismaster\000\001\003topologyVersion\000-\000\000\000\aprocessId\000f\225\335\246B(\\C\202\2468\351\022counter\000\000\000\000\000\000\000\000\000\000\020maxBsonObjectSize\000\000\000\000\001\020maxMessageSizeBytes\000\000l\334\002\020maxWriteBatchSize\000\240\206\001\000\tlocalTime\000\032T\246\271\220\001\000\000\020logicalSessionTimeoutMinutes\000\036\000\000\000\020connectionId\000*\000\000\000\020minWireVersion\000\000\000\000\000\020maxWireVersion\000\025\000\000\000\breadOnly\000\000\001ok\000\000\000\000\000\000\000\360?";
 
-    if (EV_ERROR & revents) {
-        perror("got invalid event");
-        return;
-    }
-
-    read = recv(watcher->fd, buffer, BUFFER_SIZE, 0);
-
-    if (read < 0) {
-        perror("read error");
-        return;
-    }
-
-    if (read == 0) {
-        ev_io_stop(loop, watcher);
-        close(watcher->fd);
-        free(watcher);
-        return;
-    }
-
-    msg_length = ((u_int32_t *) buffer)[0];
+    worker_commands++;
     request_id = ((u_int32_t *) buffer)[1];
     response_to = ((u_int32_t *) buffer)[2];
     op_code = ((u_int32_t *) buffer)[3];
@@ -1116,19 +5072,22 @@ void read_cb(struct ev_loop *loop, struct ev_io *watcher, int revents) {
             //parse_query(buffer);
             elog(WARNING, "send reply");
             random_new_req_id(response);
-            send(watcher->fd, response, sizeof(response), 0);
+            client_send(client, response, sizeof(response));
             elog(WARNING, "reply was sent");
             break;
         case OP_MSG:
+            /* flagBits, kind of the first section and the first key of its body, which names the command */
+            if (msg_length < MSG_HEADER_LEN + 11) {
+                elog(WARNING, "pg_proxy: OP_MSG of %u bytes is ignored", msg_length);
+                break;
+            }
 
-            query_string = (char **) malloc(sizeof(char *));
-            parameter_string = (char **) malloc(sizeof(char *));
-            *query_string = NULL;
-            *parameter_string = NULL;
+            mongo_msg_t msg = {0};
 
-            parse_message(buffer, query_string, parameter_string);
+            parse_message((char *) buffer, &msg);
 
-            struct json_object *results;
+            find_reply_t find_reply;
+            find_reply_init(&find_reply);
             char **dbname = (char **) malloc(sizeof(char *));
             *dbname = (char *) malloc(256);
             memset(*dbname, 0, 256);
@@ -1136,79 +5095,97 @@ void read_cb(struct ev_loop *loop, struct ev_io *watcher, int revents) {
             *collection = (char *) malloc(256);
             memset(*collection, 0, 256);
             int changed_count = 0;
-            process_message(request_id, buffer, *query_string, *parameter_string, &flag, &results, dbname, collection,
-                            &changed_count);
+            process_message(request_id, buffer, &msg, &flag, &find_reply, dbname,
+                            collection, &changed_count);
             if (flag == 2) {
                 elog(WARNING, "send ping");
                 modify_ping_endsessions_reply(ping_endsessions_ok, request_id);
-                send(watcher->fd, ping_endsessions_ok, PING_ENDSESSIONS_REPLY_LEN, 0);
+                client_send(client, ping_endsessions_ok, PING_ENDSESSIONS_REPLY_LEN);
                 elog(WARNING, "ping was sent");
             }
             if (flag == 3) {
                 elog(WARNING, "send insert");
                 modify_insert_delete_reply(insert_delete_ok, request_id, changed_count);
-                send(watcher->fd, insert_delete_ok, INSERT_DELETE_REPLY_LEN, 0);
+                client_send(client, insert_delete_ok, INSERT_DELETE_REPLY_LEN);
                 elog(WARNING, "insert was sent");
             }
             if (flag == 6) {
                 elog(WARNING, "send delete");
                 modify_insert_delete_reply(insert_delete_ok, request_id, changed_count);
-                send(watcher->fd, insert_delete_ok, INSERT_DELETE_REPLY_LEN, 0);
+                client_send(client, insert_delete_ok, INSERT_DELETE_REPLY_LEN);
                 elog(WARNING, "delete was sent");
             }
             if (flag == 8) {
                 elog(WARNING, "send update");
                 modify_update_reply(update_ok, response_to, changed_count);
-                send(watcher->fd, update_ok, UPDATE_REPLY_LEN, 0);
+                client_send(client, update_ok, UPDATE_REPLY_LEN);
                 elog(WARNING, "update was sent");
             }
             if (flag == 10) {
                 elog(WARNING, "send find");
-                //char find_reply[BUFFER_SIZE];
-                char *find_reply = (char *)malloc(BUFFER_SIZE);
-                memset(find_reply, 0, BUFFER_SIZE);
-                int find_reply_len = generate_find_reply_packet(results, find_reply, 0x06, *dbname, *collection);
-                if (find_reply_len == -1) {
-                    elog(WARNING, "generate_find_reply_packet got an error");
-                }
-                send(watcher->fd, find_reply, find_reply_len, 0);
-                
-                free(find_reply);
-                json_object_put(results);
+                size_t find_reply_len;
+                unsigned char *packet = find_reply_finish(&find_reply, request_id, *dbname, *collection,
+                                                          &find_reply_len);
+                client_send_packet(client, packet, find_reply_len);
+            }
+            if (flag == 11) {
+                size_t reply_len;
+                unsigned char *packet = op_msg_pack(&find_reply.body, request_id, &reply_len);
+                client_send_packet(client, packet, reply_len);
                 elog(WARNING, "find was sent");
             }
             if (flag == 5) {
                 elog(WARNING, "terminate session");
                 modify_ping_endsessions_reply(ping_endsessions_ok, request_id);
-                send(watcher->fd, ping_endsessions_ok, PING_ENDSESSIONS_REPLY_LEN, 0);
+                client_send(client, ping_endsessions_ok, PING_ENDSESSIONS_REPLY_LEN);
                 elog(WARNING, "session was terminated");
             }
             
-            if (*query_string != NULL) {
-                free(*query_string);
-            }
-            if (*parameter_string != NULL) {
-                free(*parameter_string);
-            }
-            if (query_string != NULL) {
-                free(query_string);
-            }
-            if (parameter_string != NULL) {
-                free(parameter_string);
-            }
-            
             free(*dbname);
             free(*collection);
             free(dbname);
             free(collection);
+            mongo_msg_free(&msg);
+            find_reply_free(&find_reply);
             break;
         default:
             perror("UNKNOWN OP_CODE\n");
             return;
     }
+}
+
+void read_cb(struct ev_loop *loop, struct ev_io *watcher, int revents) {
+    if (EV_ERROR & revents) {
+        perror("got invalid event");
+        return;
+    }
+
+    client_resume((client_t *) watcher);
+}
+
+/**
+ * writes queued replies once the socket of the client takes more,
+ * reading from the client resumes when its queue drains to OUTPUT_LOW_WATER
+ */
+void write_cb(struct ev_loop *loop, struct ev_io *watcher, int revents) {
+    client_t *client = (client_t *) watcher->data;
 
-    memset(buffer, 0, BUFFER_SIZE);
+    client_flush(client);
+
+    /* a coroutine waiting for PostgreSQL notices closed after its message, an idle one is resumed to free the client */
+    if (client->closed) {
+        if (client->read_paused || ev_is_active(&client->io)) {
+            ev_io_stop(loop, &client->io);
+            client->read_paused = false;
+            client_resume(client);
+        }
+        return;
+    }
 
+    if (client->read_paused && client->out_queued <= OUTPUT_LOW_WATER) {
+        client->read_paused = false;
+        ev_io_start(loop, &client->io);
+    }
 }
 
 void _PG_init(void) {
@@ -1217,36 +5194,52 @@ void _PG_init(void) {
     pqsignal(SIGTERM, handle_sigterm);
     pqsignal(SIGINT, handle_sigterm);
     BackgroundWorkerUnblockSignals();
+
+    DefineCustomEnumVariable("pg_proxy.backend",
+                             "Selects how the proxy executes translated commands.",
+                             "libpq uses loopback connections, spi runs commands to pg_proxy.database "
+                             "inside the proxy worker.",
+                             &proxy_backend, PROXY_BACKEND_LIBPQ, proxy_backend_options,
+                             PGC_POSTMASTER, 0, NULL, NULL, NULL);
+    DefineCustomStringVariable("pg_proxy.database",
+                               "Database the proxy worker connects to when pg_proxy.backend is spi.",
+                               NULL, &proxy_database, "postgres",
+                               PGC_POSTMASTER, 0, NULL, NULL, NULL);
+    DefineCustomIntVariable("pg_proxy.workers",
+                            "Number of proxy worker processes sharing the MongoDB port.",
+                            "Cursors stay in the worker that opened them, getMore reaching another worker fails.",
+                            &proxy_workers, 1, 1, PROXY_MAX_WORKERS,
+                            PGC_POSTMASTER, 0, NULL, NULL, NULL);
+    MarkGUCPrefixReserved("pg_proxy");
+
     memset(&worker, 0, sizeof(BackgroundWorker));
     worker.bgw_flags = BGWORKER_SHMEM_ACCESS | BGWORKER_BACKEND_DATABASE_CONNECTION;
     worker.bgw_start_time = BgWorkerStart_ConsistentState;
     worker.bgw_restart_time = BGW_NEVER_RESTART;
     snprintf(worker.bgw_library_name, BGW_MAXLEN, "pg_proxy");
     snprintf(worker.bgw_function_name, BGW_MAXLEN, "main_proxy");
-    snprintf(worker.bgw_name, BGW_MAXLEN, "Proxy");
     snprintf(worker.bgw_type, BGW_MAXLEN, "Proxy");
 
-    RegisterBackgroundWorker(&worker);
+    for (int i = 0; i < proxy_workers; i++) {
+        snprintf(worker.bgw_name, BGW_MAXLEN, "Proxy %d", i);
+        worker.bgw_main_arg = Int32GetDatum(i);
+        RegisterBackgroundWorker(&worker);
+    }
 }
 
 /**
  * return 0 if everything is successful
  * return -1 if not (for example, if smth with length of char *buffer)
  */
-int parse_message(char *buffer, char **query_string, char **parameter_string) {
+int parse_message(char *buffer, mongo_msg_t *msg) {
     u_int32_t flags = ((u_int32_t *) buffer)[4];
     int overall_sections_start_bit = 20; //because of mongodb protocol
     int overall_sections_end_bit = ((u_int32_t *) buffer)[0]; //msg_length
     u_int32_t msg_length = ((u_int32_t *) buffer)[0]; //msg_length
     u_int32_t checksum = 0;
     char section_kind = 0;
-    bson_t *b[MAX_BSON_OBJECTS]; //array of *bson_t formed by parsing OP_MSG message type
-    int next_bson_to_get = 0; //an index of b to be filled next
+    bson_t *doc; //bson formed by parsing OP_MSG section, kept in msg
     int section_start = 0;
-    //for converting strings to query_string, parameter_string
-    int par_string_len;
-    int len_of_par_strings = 0;
-    char **jsons;
 
     if (flags && (1 << 7)) {
         overall_sections_end_bit -= 4; //it means there is a checksum in the end of the packet
@@ -1269,12 +5262,12 @@ int parse_message(char *buffer, char **query_string, char **parameter_string) {
                  * A body section is encoded as a single BSON object.
                  * The size in the BSON object also serves as the size of the section.
                  * */
-                int flag_local = parse_bson_object((buffer + section_start), &(b[next_bson_to_get]));
+                int flag_local = parse_bson_object((buffer + section_start), &doc);
                 if (flag_local < 0) {
                     return -1; //it means smth bad with parsing bson
                 }
 
-                next_bson_to_get++;
+                mongo_msg_add(msg, doc);
                 add_to_section_start += ((u_int32_t * )(buffer + section_start))[0];
                 break;
             case DOC_MSG_SECTION_TYPE:
@@ -1297,13 +5290,13 @@ int parse_message(char *buffer, char **query_string, char **parameter_string) {
                 int j = 0;
                 for (j = section_start + add_to_section_start; j < section_start + size_section;) {
                     u_int32_t my_bson_size = ((u_int32_t * )(buffer + j))[0];
-                    int flag_local = parse_bson_object((char *) (buffer + j), &(b[next_bson_to_get]));
+                    int flag_local = parse_bson_object((char *) (buffer + j), &doc);
                     if (flag_local < 0) {
                         elog(ERROR, "PROBLEMS WITH PARSING BSON\n");
                         return -1; //it means smth bad with parsing bson
                     }
 
-                    next_bson_to_get++;
+                    mongo_msg_add(msg, doc);
                     j += my_bson_size;
                 }
                 add_to_section_start = j - section_start;
@@ -1321,64 +5314,57 @@ int parse_message(char *buffer, char **query_string, char **parameter_string) {
     }
 
     //it  means there were no bsons
-    if (next_bson_to_get == 0) {
+    if (msg->count == 0) {
         return -1;
     }
 
-    size_t len_of_string = 0;
-    char *str = bson_as_relaxed_extended_json(b[0], &len_of_string);
-    *query_string = (char *) malloc(len_of_string + 1);
-    memset(*query_string, 0, len_of_string + 1);
-    memcpy(*query_string, str, len_of_string);
-    bson_free(str);
-
-
-    jsons = (char **) malloc((next_bson_to_get - 1) * sizeof(char *));
-
-
-    for (int i = 1; i < next_bson_to_get; ++i) {
-        size_t len_of_string = 0;
-        jsons[i] = bson_as_relaxed_extended_json(b[i], &len_of_string);
-
-        len_of_par_strings += len_of_string;
-    }
-
-    if (next_bson_to_get != 1) {
-
-        par_string_len = (len_of_par_strings + 2 * (next_bson_to_get - 1) + 1) * sizeof(char *);
-
-        *parameter_string = (char *) malloc(par_string_len);
-        int now = 0;
-
-        memset(*parameter_string, 0, par_string_len);
-        memcpy(*parameter_string, "[", 1);
-        now += 1;
-
-        for (int i = 1; i < next_bson_to_get; ++i) {
-            if (i + 1 != next_bson_to_get) {
-
-                memcpy((char *) (*parameter_string + now), jsons[i], strlen(jsons[i]));
-                now += strlen(jsons[i]);
-                memcpy((char *) (*parameter_string + now), ", ", 2);
-                now += 2;
-            } else {
-                memcpy((char *) (*parameter_string + now), jsons[i], strlen(jsons[i]));
-                now += strlen(jsons[i]);
-                memcpy((char *) (*parameter_string + now), "]", 1);
-                now += 1;
+    //documents of a batch are read straight from BSON by the translators,
+    //without a document sequence they come in an array of the body
+    static const char *const batch_arrays[][2] = {{"insert",   "documents"},
+                                                  {"delete",   "deletes"},
+                                                  {"update",   "updates"}};
+    bson_iter_t iter;
+    if (msg->count == 1 && bson_iter_init(&iter, msg->docs[0]) && bson_iter_next(&iter)) {
+        for (int i = 0; i < (int) (sizeof(batch_arrays) / sizeof(batch_arrays[0])); i++) {
+            bson_iter_t array, child;
+            if (strcmp(bson_iter_key(&iter), batch_arrays[i][0]) != 0 ||
+                !bson_iter_init_find(&array, msg->docs[0], batch_arrays[i][1]) || !BSON_ITER_HOLDS_ARRAY(&array) ||
+                !bson_iter_recurse(&array, &child)) {
+                continue;
+            }
+            while (bson_iter_next(&child)) {
+                if (BSON_ITER_HOLDS_DOCUMENT(&child)) {
+                    uint32_t doc_len;
+                    const uint8_t *doc_data;
+                    bson_iter_document(&child, &doc_len, &doc_data);
+                    mongo_msg_add(msg, bson_new_from_data(doc_data, doc_len));
+                }
             }
         }
     }
+    return 0;
+}
 
 
-    for (int i = 1; i < next_bson_to_get; ++i) {
-        bson_free(jsons[i]);
+/**
+ * keeps a document of the message, the message owns it
+ */
+void mongo_msg_add(mongo_msg_t *msg, bson_t *doc) {
+    if (msg->count == msg->capacity) {
+        msg->capacity = msg->capacity == 0 ? 8 : msg->capacity * 2;
+        msg->docs = (bson_t **) realloc(msg->docs, sizeof(bson_t *) * msg->capacity);
     }
-
-    free(jsons);
-    return 0;
+    msg->docs[msg->count++] = doc;
 }
 
+void mongo_msg_free(mongo_msg_t *msg) {
+    for (int i = 0; i < msg->count; i++) {
+        bson_destroy(msg->docs[i]);
+    }
+    free(msg->docs);
+    msg->docs = NULL;
+    msg->count = msg->capacity = 0;
+}
 
 /**
  * <just a light wrapper on bson_new_from_data(const uint8_t *data, size_t length) from libbson.h
@@ -1389,7 +5375,7 @@ int parse_message(char *buffer, char **query_string, char **parameter_string) {
 int parse_bson_object(char *my_data, bson_t **my_bson) {
     size_t my_data_len = ((u_int32_t *) my_data)[0];
     *my_bson = bson_new_from_data(my_data, my_data_len);
-    if (!my_bson) {
+    if (!*my_bson) {
         return -1;
     }
     return 0;
@@ -1440,672 +5426,136 @@ void modify_update_reply(unsigned char *reply, u_int32_t response_to, int nmodif
     ((u_int32_t * )(reply + 3))[(43 - 3) / 4] = nmodified;
 }
 
-
-/**
- * generates the find reply packet
- * arguments: data_array - json having args to answer
- *      reply - buffer to put the Mongodb protocol packet
- *      db_name, table_name - names of db and table where we got data_array from
- * 
- * returns lentgs of the packet in bytes if everything is good
- * if smth went wrong, returns -1
- */
-int generate_find_reply_packet(struct json_object *data_array, 
-    char *reply, uint32_t response_to, char *db_name, char *table_name) {
-    /**
-     * structure of find_reply_packet:
-     * [0 - 3] message length
-     * [4 - 7] request_id
-     * [8 - 11] response_to
-     * [12 - 15] opcode
-     * [16 - 19] message flags
-     * //start of the section
-     * [20] = 0 kind: Body
-     * //start of the BodyDocument
-     * [21 - 24] Document lenght = 4 (the doclength itself)
-     *                              + size of Element: cursor
-     *                              + size of Element: ok
-     *                              + 1 (= 0 :  end of the BodyDocument)
-     * [25 - ...] Element: cursor
-     * [... + 1 - ...] ok
-     * [... + 1] = 0 end of the BodyDocument
-     * //end of the Section
-     */
-
-    int doc_size = 4;
-    char cursor_buffer[BUFFER_SIZE];
-    int cursor_size;
-
-    int message_lenght = 0;
-    random_new_req_id(reply); //[4 - 7] request_id
-    ((uint32_t *)(reply))[2] = response_to;
-    memcpy(reply + 12, "\335\a\000\000", 4); //opcode
-    memcpy(reply + 19, "\000\000\000\000", 4);
-    reply[20] = 0;
-
-
-    
-
-    
-    memset(cursor_buffer, 0, BUFFER_SIZE);
-    cursor_size = generate_cursor(data_array, cursor_buffer, db_name, table_name);
-    if (cursor_size == -1) {
-        elog(WARNING, "generate_cursor got an error");
-        return -1;
-    }
-
-    memcpy(reply + 21 + doc_size, cursor_buffer, cursor_size);
-    doc_size += cursor_size;
-
-    memcpy(reply + 21 + doc_size, "\001ok\000\000\000\000\000\000\000\360?", 12);
-    doc_size += 12;
-    reply[21 + doc_size] = 0; //end of the BodyDocument
-    doc_size++;
-    
-
-    //setting the document size
-    ((uint32_t *)(reply + 21))[0] = doc_size;
-
-    //setting the message length
-    message_lenght += doc_size + 21;
-    ((uint32_t *)(reply))[0] = message_lenght;
-
-    return message_lenght;
-}
-
-
-/**
- * return reply_size if everything is good
- * return -1 if something went wrong
- * 
- */
-int generate_cursor(struct json_object *data_array, char *reply, char *db_name, char *table_name) {
-    /**
-     * struct of element: cursor
-     * [0] = 0x03 type: Document 
-     * [1-6] = "cursor"
-     * [7] = 0
-     * //then goes Document
-     * [8-11] Document length
-     * [12 - ...] element : firstBatch
-     * [... - ...] element: id
-     * [... - ...] element: ns
-     * [... + 1] = 0 - end of the Document
-     */
-    
-    char first_batch_reply[BUFFER_SIZE];
-    char id[] = "\022id\000\000\000\000\000\000\000\000\000";
-    char ns_reply[BUFFER_SIZE];
-    int first_batch_size;
-    int ns_size;
-
-    int now_to_put = 0;
-    reply[0] = 0x03;
-    memcpy(reply + 1, "cursor", 7);
-
-
-    
-    memset(first_batch_reply, 0, BUFFER_SIZE);
-    //LATER: CHANGE 0 (reply_find_process_array::place_to_put) TO now_to_put
-    first_batch_size = reply_find_process_array("firstBatch", data_array, first_batch_reply, 0);
-    if (first_batch_size == -1) {
-        elog(WARNING, "reply_find_process_array got an error");
-        return -1;
-    }
-
-    now_to_put = 12;
-    memcpy(reply + now_to_put, first_batch_reply, first_batch_size);
-    now_to_put += first_batch_size;
-
-    
-    memcpy(reply + now_to_put, id, 12);
-    now_to_put +=12;
-
-    
-    memset(ns_reply, 0, BUFFER_SIZE);
-    ns_size = generate_ns_element(ns_reply, db_name, table_name);
-    if (ns_size == -1) {
-        elog(WARNING, "generate_ns_element got an error");
-        return -1;
-    }
-    memcpy(reply + now_to_put, ns_reply, ns_size);
-    now_to_put += ns_size;
-    reply[now_to_put] = 0; //end of the Document
-    now_to_put++;
-
-
-    //setting the Document length
-    ((uint32_t *)(reply + 8))[0] = now_to_put - 8;
-    return now_to_put;
-}
-
-
-/**
- * return reply_size if everything is good
- * return -1 if something went wrong
- * 
- * ns includes db_name and table_name we got data from
- */
-int generate_ns_element(char *reply, char *db_name, char *table_name) {
-    /**
-     * structure of ns
-     * [0] = 0x02 type: string
-     * [1-2] = "ns"
-     * [3] = 0 (like end of string)
-     * [4 - 7] = length of string
-     * [8 - ...] = string (db_name.table_name) (it includes!!! 0 in the end of the string)
-     * 
-     */
-    int value_size = 0;
-    reply[0] = 0x02;
-    reply[1] = 0x6e;
-    reply[2] = 0x73;
-    reply[3] = 0;
-
-
-    memcpy(reply + 8, db_name, strlen(db_name));
-    value_size += strlen(db_name);
-    reply[8 + value_size] = 0x2e; //= '.'
-    value_size++;
-    memcpy(reply + 8 + value_size, table_name, strlen(table_name));
-    value_size += strlen(table_name);
-    reply[8 + value_size] = 0; // 0 in the end of the string
-    //bc 0 int hte end of the string must be included to the lenght of the string
-    value_size++;
-    //setting length of element
-    ((uint32_t *)(reply))[1] = value_size;
-    return value_size + 8;
+/* starts empty reply body of a find, getMore or killCursors */
+void find_reply_init(find_reply_t *reply) {
+    bson_init(&reply->body);
+    reply->packet = NULL;
+    reply->len = 0;
+    reply->cap = 0;
+    reply->n_docs = 0;
+    reply->cursor_id = 0;
+    reply->started = false;
+    reply->key_columns = 0;
+    memset(reply->last_key, 0, sizeof(reply->last_key));
 }
 
-
 /**
- * args: value_str - string to be placed to buffer
- *          *now_to_put - start place in buffer to put
- * *now_to_put would be changed during processing
+ * reserves the message header and opens the cursor document with its batch array named batch_name,
+ * rows are appended to the batch
  */
-void reply_find_process_string(const char *field_str, const char *value_str, char *buffer, int *now_to_put) {
-    char lilbuf[4];
-
-    buffer[*now_to_put] = 0x02;
-    (*now_to_put)++;
-    //here we put name of the field
-    memcpy((buffer + *now_to_put), field_str, strlen(field_str) + 1); // copy field name to el
-    (*now_to_put) += strlen(field_str) + 1;
-    //here we put size of the field
-    
-    memset(lilbuf, 0, 4);
-    int my_len = strlen(value_str) + 1;
-    int num_16_digits = 0;
-    while (my_len != 0) {
-        my_len /= 256;
-        num_16_digits++;
-    }
-
-    my_len = strlen(value_str) + 1;
-
-    for(int i = 0; i < num_16_digits; i++) {
-        lilbuf[i] = my_len % 256;
-        my_len /= 256;
-    }
-    
-    for (int i = 0; i < 4; ++i) {
-        if (lilbuf[i]) {
-            buffer[*now_to_put + i] = lilbuf[i]; //- '0';
-        } else {
-            buffer[*now_to_put + i] = lilbuf[i];
-        }
-        
-    }
-    (*now_to_put) += 4;
-    //here we put field value
-    memcpy((buffer + *now_to_put), value_str, strlen(value_str));
-    *now_to_put += strlen(value_str);
-    buffer[*now_to_put] = 0;
-    (*now_to_put)++;
-}
-
-void reply_find_process_int32(const char *field_str, const char *value_str, char *buffer, int *now_to_put) {
-    //here we put type
-    buffer[*now_to_put] = 0x10; //16
-    (*now_to_put)++;
-    //here we put name of the field
-    memcpy((buffer + *now_to_put), field_str, strlen(field_str) + 1); // copy field name to el
-    (*now_to_put) += strlen(field_str) + 1;
-
-    //here we put field value
-    *(int32_t *)(&buffer[0] + *now_to_put) = (int32_t) atoi(value_str);
-    (*now_to_put) += 4;
-}
-
-void reply_find_process_boolean(const char *field_str, const char *value_str, char *buffer, int *now_to_put) {
-    //here we put type
-    buffer[*now_to_put] = 0x08; //16
-    (*now_to_put)++;
-    //here we put name of the field
-    memcpy((buffer + *now_to_put), field_str, strlen(field_str) + 1); // copy field name to el
-    (*now_to_put) += strlen(field_str) + 1;
-    //here we put field value
-    *(u_int8_t *)(&buffer[0] + *now_to_put) = (u_int8_t) atoi(value_str) > 0 ? 1 : 0;
-    (*now_to_put) += 1;
+void find_reply_begin(find_reply_t *reply, const char *batch_name) {
+    static const unsigned char cursor_element[] = {BSON_TYPE_DOCUMENT, 'c', 'u', 'r', 's', 'o', 'r', '\0'};
+    size_t name_len = strlen(batch_name);
+
+    /* message header, flag bits, section kind and length of the body come first */
+    reply->len = 0;
+    find_reply_reserve(reply, FIND_REPLY_CURSOR_AT + 4 + 1 + name_len + 1 + 4);
+    unsigned char *p = reply->packet + FIND_REPLY_CURSOR_AT - sizeof(cursor_element);
+    memcpy(p, cursor_element, sizeof(cursor_element));
+    p += sizeof(cursor_element) + 4;
+    *p++ = BSON_TYPE_ARRAY;
+    memcpy(p, batch_name, name_len + 1);
+    p += name_len + 1;
+    reply->array_at = p - reply->packet;
+    reply->len = reply->array_at + 4;
+    reply->n_docs = 0;
+    reply->started = true;
 }
 
-void reply_find_process_double(const char *field_str, const char *value_str, char *buffer, int *now_to_put) {
-    //here we put type
-    buffer[*now_to_put] = 0x01; //16
-    (*now_to_put)++;
-    //here we put name of the field
-    memcpy((buffer + *now_to_put), field_str, strlen(field_str) + 1); // copy field name to el
-    (*now_to_put) += strlen(field_str) + 1;
-    //here we put field value
-    *(int64_t *)(&buffer[0] + *now_to_put) = (int64_t) atoi(value_str);
-    (*now_to_put) += 8;
-}
-
-
-/**
- * return number of written bytes
- * arguments: field_str - name of array, 
- *      data_json - json keepeng elements of the array, 
- *      buffer to write answer to
- *      place_to_put - start position in buffer to put elements
- * 
- * forms array as Mongodb protocol needs
- */
-int reply_find_process_array(const char *field_str, 
-    struct json_object *data_json, char *buffer, int place_to_put) {
-    /**
-     * struct
-     * 
-     * buffer + place_to_put = 0 place
-     * [0] = type
-     * [1 - strlen(fieldstr) + 1] = name of the array (in must include 0 in the end of the string )
-     * [strlen(fieldstr) + 1 - strlen(fieldstr) + 4] length of the doc
-     * then elements ...
-     * [last] = 0 - 0 of the doc
-     * MAYBE ONE MORE 0 (CHECK LATER!!!)
-     */
-
-    int place_for_doc_length;
-    int array_length;
-    char el_reply[BUFFER_SIZE];
-    struct json_object *el_json;
-    int el_i_size;
-
-    int start_place_to_put = place_to_put;
-    //here we put type
-    buffer[place_to_put] = 0x04;
-    place_to_put++;
-    //here we put name of the field
-    memcpy((buffer + place_to_put), field_str, strlen(field_str) + 1); // copy field name to el
-    place_to_put += strlen(field_str) + 1;
-    place_for_doc_length = place_to_put;
-    place_to_put += 4;
-    
-    array_length = json_object_array_length(data_json);
-
-    
-    /**
-     * we go throw data_array (thow all jsons we have), process them and add result to our reply
-     */
-    if (array_length > 0) {
-        for (int i = 0; i < array_length; i++) {
-            el_json = json_object_array_get_idx(data_json, i);
-
-            //LATER
-            //CHANGE ON MAIN BUFFER!!!!!
-            memset(el_reply, 0, BUFFER_SIZE);
-            el_i_size = reply_find_generate_array_element_i(el_json, el_reply, 0, i);
-            if (el_i_size == -1) {
-                //everything is bad
-                elog(WARNING, "reply_find_generate_array_element_i got an error");
-                return -1;
-            }
-
-            memcpy(buffer + place_to_put, el_reply, el_i_size);
-            place_to_put += el_i_size;
-            json_object_put(el_json);
-        }
-    }
-
-    buffer[place_to_put] = 0;
-    place_to_put++;
-    ((u_int32_t *)(buffer + place_for_doc_length))[0] = (u_int32_t) place_to_put - place_for_doc_length;
-    return place_to_put - start_place_to_put;
+/* replaces the reply with an error, drivers pass code and errmsg to the application */
+void find_reply_error(find_reply_t *reply, int code, const char *code_name, const char *errmsg) {
+    reply->started = false;
+    reply->len = 0;
+    bson_reinit(&reply->body);
+    bson_append_double(&reply->body, "ok", -1, 0.0);
+    bson_append_utf8(&reply->body, "errmsg", -1, errmsg, -1);
+    bson_append_int32(&reply->body, "code", -1, code);
+    bson_append_utf8(&reply->body, "codeName", -1, code_name, -1);
 }
 
+/* errmsg of an error reply set by find_reply_error, empty string for other replies */
+const char *find_reply_errmsg(const find_reply_t *reply) {
+    bson_iter_t iter;
 
-/**
- * return number of written bytes
- * arguments: data_json - json keepeng i element of the array, 
- *      buffer to write answer to
- *      place_to_put - start position in buffer to put elements
- *      num_of_element = i
- * 
- * forms i element of array
- */
-int reply_find_generate_array_element_i(struct json_object *data_json, char *buffer, int place_to_put, int number_of_el) {
-    /**
-     * structure of element: i
-     * [0](byte) type: Document (0x03)
-     * [1](byte) Element: 30 + number_of_el - bc i found it in traces
-     * [2]byte = 0
-     * [3-6]4 bytes : document lenght
-     * [7-...]then elements we got from generate_subelemets_string()
-     * [... + 1]byte = 0
-     */
-    
-    char answer[BUFFER_SIZE];
-    int ne_copy;
-    int digits_number;
-    int reply_size;
-    int ans_size;
-
-    int start_place_to_put = place_to_put;
-    buffer[place_to_put] = 0x03;
-    place_to_put++;
-    //reply[1] = (char)(0x30 + number_of_el);
-    ne_copy = number_of_el;
-    digits_number = 0;
-    if (number_of_el == 0) {
-        digits_number = 1;
-    } else {
-        while (ne_copy != 0) {
-            ne_copy /= 10;
-            digits_number++;
-        }
-    }
-
-
-    ne_copy = number_of_el;
-    for (int i = place_to_put + digits_number - 1; i >= place_to_put; i--) {
-        buffer[i] = (char)(0x30 + ne_copy % 10); 
-        ne_copy /= 10;
-    }
-    place_to_put += digits_number;
-    buffer[place_to_put] = 0;
-    place_to_put++;
-
-    memset(answer, 0, BUFFER_SIZE);
-    //LATER: CHANGE 0 (reply_find_generate_subelemets_string::place_to_put) TO place_to_put
-    ans_size = reply_find_generate_subelemets_string(data_json, answer, 0);
-    if (ans_size < 0) {
-        elog(WARNING, "reply_find_generate_subelemets_string got an error");
-        return -1;
-    }
-
-    memcpy((buffer + start_place_to_put + 6 + digits_number), answer, ans_size);
-    buffer[start_place_to_put + 6 + digits_number + ans_size] = 0;
-
-    //counting reply_size
-    reply_size = 6 + digits_number + ans_size + 1;
-    //setting the Document length (it is = reply_size - 2(at the start of the document) - digits_number)
-    ((uint32_t *)(buffer + start_place_to_put + 2 + digits_number))[0] = reply_size - 2 - digits_number;
-    return reply_size;
-}
-
-/**
- * return type of json_value
- * currently supports: int32, string, boolean, double
- * return
- * string: 2 = 0x02
- * int32: 16 = 0x10
- * boolean: 8 = 0x08
- * double: 1 = 0x01
- * object: 3
- * array: 4
- * null: 10
- * else: -1
- */
-int get_type_of_value(struct json_object *field_value) {
-    if (json_object_is_type(field_value, json_type_string)) {
-        return 0x02;
-    } else if (json_object_is_type(field_value, json_type_int)) {
-        return 0x10;
-    } else if (json_object_is_type(field_value, json_type_boolean)) {
-        return 0x08;
-    } else if (json_object_is_type(field_value, json_type_double)) {
-        return 0x01;
-    } else if (json_object_is_type(field_value, json_type_object)) {
-        return  0x03;
-    } else if (json_object_is_type(field_value, json_type_array)) {
-        return  0x04;
-    } else if (json_object_is_type(field_value, json_type_null)) {
-        return  10;
+    if (bson_iter_init_find(&iter, &reply->body, "errmsg") && BSON_ITER_HOLDS_UTF8(&iter)) {
+        return bson_iter_utf8(&iter, NULL);
     }
-    return -1;
+    return "";
 }
 
 /**
- * auxiliary function for reply_find_generate_array_element_i
- * 
- * return size of reply (bytes) if everything is fine
- * return -1 if something went wrong
+ * puts the body into OP_MSG packet answering request response_to
+ * returns malloc'd packet, its length is stored in len
  */
-int reply_find_generate_subelemets_string(struct json_object *data_json, char *buffer, int place_to_put) {
-    /**
-     * structure
-     * we got data_json, which have some fields. 
-     * We process them depending on their data type
-     */
-    int start_place_to_put = place_to_put;
-    int real_size = 0;
-    int now_to_put = 0;
-    int type;
-    
-
-    struct json_object_iterator it = json_object_iter_begin(data_json);
-    struct json_object_iterator it_end = json_object_iter_end(data_json);
-
-
-
-    /**
-     * meaningful element structure:
-     * type: type of value - 1 byte
-     * name of the field: - how much needed (it DOES end with '\0')
-     * lenght: 4 byte (ONLY if type is string)
-     * value:
-     */
-    while (!json_object_iter_equal(&it, &it_end)) {
-        const char *value_str;
-        char el[BUFFER_SIZE];
-        memset(el, 0, BUFFER_SIZE);
-        real_size = 0;
-        now_to_put = 0;
-        
-
-        const char *field_str = json_object_iter_peek_name(&it);
-        struct json_object *value_json = json_object_iter_peek_value(&it);
-
-        //here we get type
-        type = get_type_of_value(value_json);
-        if (type == -1) {
-            elog(WARNING, "get_type_of_value got en error: type: %d field_str: %s", type, field_str);
-            return -1;
-        }
-
-        //here we put size of the field (if needed) and field value
-        //declaration of value_str was put to cases 
-        //because in some cases call of get_json_value_as_string() leads to segfault (f.e., if type is object(Document))
-
-        //LATER: EVERYWHERE el CHANGE ON BASIC BUFFER,IT IS POSSIBLE NOW
-        switch (type){
-            case 2: //string
-                value_str = get_json_value_as_string(value_json);
-                reply_find_process_string(field_str, value_str, el, &now_to_put);
-                break;
-            case 16: //int32
-                value_str = get_json_value_as_string(value_json);
-                reply_find_process_int32(field_str, value_str, el, &now_to_put);
-                break;
-            case 8: //boolean
-                value_str = get_json_value_as_string(value_json);
-                reply_find_process_boolean(field_str, value_str, el, &now_to_put);
-                break;
-            case 1: //double
-                value_str = get_json_value_as_string(value_json);
-                reply_find_process_double(field_str, value_str, el, &now_to_put);
-                break;
-            case 4: //array
-                int array_now_to_put = reply_find_process_array(field_str, value_json, el, now_to_put);
-                if (array_now_to_put == -1) {
-                    elog(WARNING, "reply_find_generate_subelemets_string got problems with reply_find_process_array");
-                    return -1;
-                }
-                now_to_put += array_now_to_put;
-                break;
-            case 3: //object
-                //WHAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAT
-                int object_now_to_put = reply_find_process_object(field_str, value_json, el, now_to_put);
-                if (object_now_to_put == -1) {
-                    elog(WARNING, "reply_find_generate_subelemets_string got problems with reply_find_process_object, manage it");
-                    return -1;
-                }
-                now_to_put += object_now_to_put;
-                break;
-
-            default:
-                elog(WARNING, "UNCKOWN TYPE IN JSON: %d\n", type);
-                return -1;
-        }
-        //here we think that el(element string) is built
-        real_size = now_to_put;
-
-        memcpy((buffer + place_to_put), el, real_size);
-        place_to_put += real_size;
-
-        
-
-        json_object_iter_next(&it);
-    }
-    //HERE OR IN reply_find_process_object THIS SHOULD BE REMOVED(I STILL DIDN'T UNDERSTEND)
-    // buffer[place_to_put] = 0;
-    // place_to_put++;
-
-    return place_to_put - start_place_to_put;
+unsigned char *op_msg_pack(const bson_t *body, uint32_t response_to, size_t *len) {
+    /* message header and flag bits are followed by the only section of kind body */
+    *len = 21 + body->len;
+    unsigned char *packet = (unsigned char *) malloc(*len);
+    ((uint32_t *) packet)[0] = (uint32_t) *len;
+    random_new_req_id(packet);
+    ((uint32_t *) packet)[2] = response_to;
+    ((uint32_t *) packet)[3] = OP_MSG;
+    ((uint32_t *) packet)[4] = 0;
+    packet[20] = BODY_MSG_SECTION_TYPE;
+    memcpy(packet + 21, bson_get_data(body), body->len);
+    return packet;
 }
 
-
 /**
- * process Object id
- * return number of elements that were put to buffer
- * if something went wrong returns -1
+ * closes the batch and the cursor document, which gets id of the cursor left open and namespace of its rows,
+ * and fills in the lengths and the message header
+ * returns malloc'd packet, its length is stored in len
  */
-int reply_find_process_oid(const char *field_str, struct json_object *data_json, char *buffer, int place_to_put) {
-    int start_place_to_put = place_to_put;
-    buffer[place_to_put] = 0x07;
-    place_to_put++;
-    memcpy((char *)(buffer + place_to_put), "_id", 4);
-    place_to_put +=4;
-    struct json_object_iterator it, it_end;
-    struct json_object *value_json;
-    const char *value_str;
-    int number_of_elements = 0;
-    char value_encoded[13];
-    int to_int ;
-
-
-    it = json_object_iter_begin(data_json);
-    it_end = json_object_iter_end(data_json);
-
-     
-    while (!json_object_iter_equal(&it, &it_end)) {
-        if (number_of_elements != 0) {
-            elog(WARNING, "reply_find_process_oid: number of elements in \"_id\" is bigger than 1!!!!!");
-            return -1;
-        }
-
-        //const char *field_str = json_object_iter_peek_name(&it);
-        value_json = json_object_iter_peek_value(&it);
-        value_str = get_json_value_as_string(value_json);
-
-        
-        memset(value_encoded, 0, 13);
-        for (int i = 0; i < strlen(value_str); i += 2) {
-            char substr[3];
-            memset(substr, 0, 3);
-            substr[0] = value_str[i];
-            substr[1] = value_str[i + 1];
-            
-            //memcpy(substr, (char *)(str + i), 2);
-            // printf("str[%d] = %c\n", i, str[i]);
-
-            
-            sscanf(substr, "%x", &to_int);
-            value_encoded[i / 2] = to_int;
-                        
-        }
-
-        memcpy((char *)(buffer + place_to_put), value_encoded, 12);
-        place_to_put +=12;
-
-
-        json_object_iter_next(&it);
-        number_of_elements++;
-    }
-    return place_to_put - start_place_to_put;
+unsigned char *find_reply_finish(find_reply_t *reply, uint32_t response_to, const char *db_name,
+                                 const char *table_name, size_t *len) {
+    char ns[512];
+    snprintf(ns, sizeof(ns), "%s.%s", db_name, table_name);
+    size_t ns_len = strlen(ns);
+
+    find_reply_reserve(reply, 1 + (1 + 3 + 8) + (1 + 3 + 4 + ns_len + 1) + 1 + (1 + 3 + 8) + 1);
+    unsigned char *packet = reply->packet;
+    unsigned char *p = packet + reply->len;
+
+    *p++ = '\0';
+    size_t array_end = p - packet;
+    *p++ = BSON_TYPE_INT64;
+    memcpy(p, "id", 3);
+    p = bson_put_int64(p + 3, reply->cursor_id);
+    *p++ = BSON_TYPE_UTF8;
+    memcpy(p, "ns", 3);
+    p = bson_put_int32(p + 3, (int32) ns_len + 1);
+    memcpy(p, ns, ns_len + 1);
+    p += ns_len + 1;
+    *p++ = '\0';
+    size_t cursor_end = p - packet;
+    *p++ = BSON_TYPE_DOUBLE;
+    memcpy(p, "ok", 3);
+    p = bson_put_double(p + 3, 1.0);
+    *p++ = '\0';
+    *len = p - packet;
+
+    ((uint32_t *) packet)[0] = (uint32_t) *len;
+    random_new_req_id(packet);
+    ((uint32_t *) packet)[2] = response_to;
+    ((uint32_t *) packet)[3] = OP_MSG;
+    ((uint32_t *) packet)[4] = 0;
+    packet[20] = BODY_MSG_SECTION_TYPE;
+    bson_put_int32(packet + 21, (int32) (*len - 21));
+    bson_put_int32(packet + FIND_REPLY_CURSOR_AT, (int32) (cursor_end - FIND_REPLY_CURSOR_AT));
+    bson_put_int32(packet + reply->array_at, (int32) (array_end - reply->array_at));
+
+    /* the caller owns the packet */
+    reply->packet = NULL;
+    reply->len = 0;
+    reply->cap = 0;
+    reply->started = false;
+    return packet;
 }
 
-/**
- * process object type
- * return number of elements that were put to buffer
- * if something went wrong returns -1
- */
-int reply_find_process_object(const char *field_str, struct json_object *data_json, char *buffer, int place_to_put) {
-    int start_place_to_put = place_to_put;
-    char answer[BUFFER_SIZE];
-    int ans_size;
-    int place_for_length;
-    
-    
-    if (strcmp(field_str, "_id") == 0) {
-        int oid_size = reply_find_process_oid(field_str, data_json, buffer, place_to_put);
-        if (oid_size == -1) {
-            elog(WARNING, "reply_find_process_object: problems with processing oid");
-            return -1;
-        }
-        place_to_put += oid_size;
-        return place_to_put - start_place_to_put;
-        return -1;
-    }
-
-    /**
-     * standart Document structure:
-     * (actually, it start with place_to_put)
-     * [0] type: Document (0x03)
-     * [1 - ...] field_str(it includes 0 at rhe end of the string)
-     * [... +1 - ... + 4] Document lenght
-     * ............... then elements we got from generate_subelemets_string()
-     * 
-     * [last] = 0 - end of the Document
-     */
-
-    buffer[place_to_put] = 0x03;
-    place_to_put++;
-    memcpy((char *) (buffer + place_to_put), field_str, strlen(field_str) + 1);
-    place_to_put += strlen(field_str) + 1;
-    place_for_length = place_to_put;
-    place_to_put += 4;
-
-    
-    memset(answer, 0, BUFFER_SIZE);
-    //LATER: CHANGE 0 (reply_find_generate_subelemets_string::place_to_put) TO place_to_put
-    ans_size = reply_find_generate_subelemets_string(data_json, answer, 0);
-    if (ans_size < 0) {
-        elog(WARNING, "reply_find_generate_subelemets_string got an error");
-        return -1;
+void find_reply_free(find_reply_t *reply) {
+    bson_destroy(&reply->body);
+    free(reply->packet);
+    for (int i = 0; i < reply->key_columns; i++) {
+        free(reply->last_key[i]);
     }
-
-    memcpy((char *)(buffer + place_to_put), answer, ans_size);
-    place_to_put += ans_size;
-
-    //HERE OR IN reply_find_generate_subelemets_string THIS SHOULD BE REMOVED(I STILL DIDN'T UNDERSTEND)
-    buffer[place_to_put] = 0;
-    place_to_put++;
-
-    //setting the Document length (it is = reply_size - 2(at the start of the document) - digits_number)
-    ((uint32_t *)(buffer + place_for_length))[0] = place_to_put - place_for_length;
-    //this is doubdtful
-    return place_to_put - start_place_to_put;
-
 }
-